@@ -39,12 +39,12 @@ print_details(void)
 	struct name *np;
 	struct rule *rp;
 
-	for (i = 0; i < HTABSIZE; i++)
+	for (i = 0; i < macrosize; i++)
 		for (mp = macrohead[i]; mp; mp = mp->m_next)
 			printf("%s = %s\n", mp->m_name, mp->m_val);
 	putchar('\n');
 
-	for (i = 0; i < HTABSIZE; i++) {
+	for (i = 0; i < namesize; i++) {
 		for (np = namehead[i]; np; np = np->n_next) {
 			if (!(np->n_flag & N_DOUBLE)) {
 				print_name(np);
@@ -3,6 +3,9 @@
  */
 #include "make.h"
 #include <glob.h>
+#if !defined(_WIN32) && !defined(_WIN64)
+# include <sys/mman.h>
+#endif
 
 int lineno;	// Physical line number in file
 int dispno;	// Line number for display purposes
@@ -57,8 +60,8 @@ skip_macro(const char *s)
 }
 
 #if !ENABLE_FEATURE_MAKE_POSIX_2024
-# define modify_words(v, m, lf, lr, fp, rp, fs, rs) \
-			modify_words(v, m, lf, lr, fs, rs)
+# define modify_words(sb, v, m, lf, lr, fp, rp, fs, rs) \
+			modify_words(sb, v, m, lf, lr, fs, rs)
 #endif
 /*
  * Process each whitespace-separated word in the input string:
@@ -66,90 +69,107 @@ skip_macro(const char *s)
  * - replace paths with their directory or filename part
  * - replace prefixes and suffixes
  *
- * Returns an allocated string or NULL if the input is unmodified.
+ * The words are appended to a buffer, separated by single spaces.
+ * If there are none the input string is appended unmodified.
  */
-static char *
-modify_words(const char *val, int modifier, size_t lenf, size_t lenr,
+static void
+modify_words(struct strbuf *sb, const char *val, int modifier,
+				size_t lenf, size_t lenr,
 				const char *find_pref, const char *repl_pref,
 				const char *find_suff, const char *repl_suff)
 {
-	char *s, *copy, *word, *sep, *newword, *buf = NULL;
+	const char *s, *word, *end, *sep;
+	size_t lenw;
+	int nwords = 0;
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 	size_t find_pref_len = 0, find_suff_len = 0;
-#endif
-
-	if (!modifier && lenf == 0 && lenr == 0)
-		return buf;
+	size_t repl_pref_len = 0, repl_suff_len = 0;
 
-#if ENABLE_FEATURE_MAKE_POSIX_2024
 	if (find_pref) {
 		// get length of find prefix, e.g: src/
 		find_pref_len = strlen(find_pref);
 		// get length of find suffix, e.g: .c
 		find_suff_len = lenf - find_pref_len - 1;
+		repl_pref_len = strlen(repl_pref);
+		repl_suff_len = repl_suff ? strlen(repl_suff) : 0;
 	}
 #endif
 
-	s = copy = xstrdup(val);
-	while ((word = gettok(&s)) != NULL) {
-		newword = NULL;
+	for (s = val; ; ) {
+		while (isblank(*s))
+			s++;
+		if (*s == '\0')
+			break;
+		word = s;
+		while (*s != '\0' && !isblank(*s))
+			s++;
+		end = s;
+
 		if (modifier) {
-			sep = strrchr(word, '/');
+			// Find the character after the last '/', or the start
+			for (sep = end; sep != word && sep[-1] != '/'; sep--)
+				;
 			if (modifier == 'D') {
-				if (!sep) {
-					word[0] = '.';	// no '/', return "."
-					sep = word + 1;
-				} else if (sep == word) {
+				if (sep == word) {
+					// no '/', return "."
+					word = ".";
+					end = word + 1;
+				} else if (sep - 1 == word) {
 					// '/' at start of word, return "/"
-					sep = word + 1;
+					end = sep;
+				} else {
+					// else terminate at separator
+					end = sep - 1;
 				}
-				// else terminate at separator
-				*sep = '\0';
-			} else if (/* modifier == 'F' && */ sep) {
-				word = sep + 1;
+			} else /* if (modifier == 'F') */ {
+				word = sep;
 			}
 		}
-		if (IF_FEATURE_MAKE_POSIX_2024(find_pref != NULL ||)
-				lenf != 0 || lenr != 0) {
-			size_t lenw = strlen(word);
+		lenw = end - word;
+
+		if (nwords++)
+			sb_append(sb, " ", 1);
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-			// This code implements pattern macro expansions:
-			//    https://austingroupbugs.net/view.php?id=519
-			//
-			// find: <prefix>%<suffix>
-			// example: src/%.c
-			//
-			// For a pattern of the form:
-			//    $(string1:[op]%[os]=[np][%][ns])
-			// lenf is the length of [op]%[os].  So lenf >= 1.
-			if (find_pref != NULL && lenw + 1 >= lenf) {
-				// If prefix and suffix of word match find_pref and
-				// find_suff, then do substitution.
-				if (strncmp(word, find_pref, find_pref_len) == 0 &&
-						strcmp(word + lenw - find_suff_len, find_suff) == 0) {
-					// replace: <prefix>[%<suffix>]
-					// example: build/%.o or build/all.o (notice no %)
-					// If repl_suff is NULL, replace whole word with repl_pref.
-					if (!repl_suff) {
-						word = newword = xstrdup(repl_pref);
-					} else {
-						word[lenw - find_suff_len] = '\0';
-						word = newword = xconcat3(repl_pref,
-									word + find_pref_len, repl_suff);
-					}
+		// This code implements pattern macro expansions:
+		//    https://austingroupbugs.net/view.php?id=519
+		//
+		// find: <prefix>%<suffix>
+		// example: src/%.c
+		//
+		// For a pattern of the form:
+		//    $(string1:[op]%[os]=[np][%][ns])
+		// lenf is the length of [op]%[os].  So lenf >= 1.
+		if (find_pref != NULL) {
+			// If prefix and suffix of word match find_pref and
+			// find_suff, then do substitution.
+			if (lenw + 1 >= lenf &&
+					memcmp(word, find_pref, find_pref_len) == 0 &&
+					memcmp(end - find_suff_len, find_suff,
+								find_suff_len) == 0) {
+				// replace: <prefix>[%<suffix>]
+				// example: build/%.o or build/all.o (notice no %)
+				// If repl_suff is NULL, replace whole word with repl_pref.
+				sb_append(sb, repl_pref, repl_pref_len);
+				if (repl_suff) {
+					sb_append(sb, word + find_pref_len,
+							lenw - find_pref_len - find_suff_len);
+					sb_append(sb, repl_suff, repl_suff_len);
 				}
-			} else
-#endif
-			if (lenw >= lenf && strcmp(word + lenw - lenf, find_suff) == 0) {
-				word[lenw - lenf] = '\0';
-				word = newword = xconcat3(word, repl_suff, "");
+				continue;
 			}
+		} else
+#endif
+		if ((lenf != 0 || lenr != 0) && lenw >= lenf &&
+				memcmp(end - lenf, find_suff, lenf) == 0) {
+			sb_append(sb, word, lenw - lenf);
+			sb_append(sb, repl_suff, lenr);
+			continue;
 		}
-		buf = xappendword(buf, word);
-		free(newword);
+		sb_append(sb, word, lenw);
 	}
-	free(copy);
-	return buf;
+
+	if (nwords == 0)
+		sb_append(sb, val, strlen(val));
 }
 
 /*
@@ -192,163 +212,497 @@ find_colon(char *p)
 # define find_colon(s) strchr(s, ':')
 #endif
 
+// Parts of a compiled string
+#define TP_TEXT		0	// Literal text
+#define TP_MACRO	1	// Macro expansion
+#define TP_UNTERM	2	// Unterminated macro expansion
+
+struct tpart {
+	int tp_type;			// One of the TP_* values
+	const char *tp_text;	// Text or name of macro
+	size_t tp_len;			// Length of text
+	struct tmpl *tp_name;	// Name of macro if it must be expanded
+	struct tmpl *tp_subst;	// Text after ':' in expansion, if any
+	char tp_modifier;		// 'D' or 'F' modifier of internal macro
+	char tp_char[2];		// Single-character name of macro
+};
+
+// A string compiled into literal text and macro expansions, so it
+// needn't be parsed again each time it's expanded.
+struct tmpl {
+	char *t_str;			// Copy of string, the parts point into it
+	int t_mode;				// Options in effect when compiled
+	int t_count;			// Number of parts
+	struct tpart t_part[];
+};
+
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+#define T_EXCEPT_DOLLAR	1	// '$$' was left unexpanded
+#define T_POSIX_2017	2	// Compiled for POSIX 2017
+
+static int
+tmpl_mode(int except_dollar)
+{
+	return (except_dollar ? T_EXCEPT_DOLLAR : 0) |
+				(POSIX_2017 ? T_POSIX_2017 : 0);
+}
+#else
+# define tmpl_mode(e) 0
+#endif
+
 /*
- * Recursively expand any macros in str to an allocated string.
+ * The internal macros support 'D' and 'F' modifiers.  If a macro
+ * name has one remove it from the name and return it.
  */
-char *
-expand_macros(const char *str, int except_dollar)
+static char
+get_modifier(char *name)
 {
-	char *exp, *newexp, *s, *t, *p, *q, *name;
-	char *find, *replace, *modified;
-	char *expval, *expfind, *find_suff, *repl_suff;
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-	char *find_pref = NULL, *repl_pref = NULL;
-#endif
-	size_t lenf, lenr;
-	char modifier;
-	struct macro *mp;
+	char modifier = '\0';
 
-	exp = xstrdup(str);
-	for (t = exp; *t; t++) {
-		if (*t == '$') {
-			if (t[1] == '\0') {
-				break;
-			}
+	switch (name[0]) {
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-			if (t[1] == '$' && except_dollar) {
-				t++;
-				continue;
-			}
+	case '^':
+	case '+':
+		if (POSIX_2017)
+			break;
+		// fall through
 #endif
-			// Need to expand a macro.  Find its extent (s to t inclusive)
-			// and take a copy of its content.
-			s = t;
-			t++;
-			if (*t == '{' || *t == '(') {
-				t = find_char(t, *t == '{' ? '}' : ')');
-				if (t == NULL)
-					error("unterminated variable '%s'", s);
-				name = xstrndup(s + 2, t - s - 2);
-			} else {
-				name = xmalloc(2);
-				name[0] = *t;
-				name[1] = '\0';
-			}
+	case '@': case '%': case '?': case '<': case '*':
+		if ((name[1] == 'D' || name[1] == 'F') && name[2] == '\0') {
+			modifier = name[1];
+			name[1] = '\0';
+		}
+		break;
+	}
+	return modifier;
+}
 
-			// Only do suffix replacement or pattern macro expansion
-			// if both ':' and '=' are found, plus a '%' for the latter.
-			// Suffix replacement is indicated by
-			// find_pref == NULL && (lenf != 0 || lenr != 0);
-			// pattern macro expansion by find_pref != NULL.
-			expfind = NULL;
-			find_suff = repl_suff = NULL;
-			lenf = lenr = 0;
-			if ((find = find_char(name, ':'))) {
-				*find++ = '\0';
-				expfind = expand_macros(find, FALSE);
-				if ((replace = find_char(expfind, '='))) {
-					*replace++ = '\0';
-					lenf = strlen(expfind);
+/*
+ * Compile a string containing macro expansions.
+ */
+static struct tmpl *
+compile_tmpl(const char *str, int except_dollar)
+{
+	struct tmpl *tp;
+	struct tpart *pp;
+	const char *s;
+	char *t, *text, *name, *find;
+	int n = 1;
+
+	for (s = str; (s = strchr(s, '$')); s++)
+		n += 2;
+	tp = xmalloc(sizeof(struct tmpl) + n * sizeof(struct tpart));
+	memset(tp->t_part, 0, n * sizeof(struct tpart));
+	tp->t_str = text = xstrdup(str);
+	tp->t_mode = tmpl_mode(except_dollar);
+	pp = tp->t_part;
+
+	for (t = text; *t; t++) {
+		if (*t != '$')
+			continue;
+		if (t[1] == '\0')
+			break;
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-					if (!POSIX_2017 && (find_suff = strchr(expfind, '%'))) {
-						find_pref = expfind;
-						repl_pref = replace;
-						*find_suff++ = '\0';
-						if ((repl_suff = strchr(replace, '%')))
-							*repl_suff++ = '\0';
-					} else
+		if (t[1] == '$' && except_dollar) {
+			t++;
+			continue;
+		}
 #endif
-					{
-						if (IF_FEATURE_MAKE_EXTENSIONS(posix &&
-									!(pragma & P_EMPTY_SUFFIX) &&)
-								lenf == 0)
-							error("empty suffix%s",
-								!ENABLE_FEATURE_MAKE_EXTENSIONS ? "" :
-									": allow with pragma empty_suffix");
-						find_suff = expfind;
-						repl_suff = replace;
-						lenr = strlen(repl_suff);
-					}
-				}
+		if (t != text) {
+			pp->tp_type = TP_TEXT;
+			pp->tp_text = text;
+			pp->tp_len = t - text;
+			pp++;
+		}
+
+		// Find the extent of the expansion and its content.
+		s = t++;
+		if (*t == '{' || *t == '(') {
+			t = find_char(t, *t == '{' ? '}' : ')');
+			if (t == NULL) {
+				// Report the error if the expansion is reached
+				pp->tp_type = TP_UNTERM;
+				pp->tp_text = s;
+				pp++;
+				text = NULL;
+				break;
 			}
+			*t = '\0';
+			name = (char *)s + 2;
+		} else {
+			pp->tp_char[0] = *t;
+			name = pp->tp_char;
+		}
+		text = t + 1;
+		pp->tp_type = TP_MACRO;
+
+		if ((find = find_char(name, ':'))) {
+			*find++ = '\0';
+			pp->tp_subst = compile_tmpl(find, FALSE);
+		}
 
-			p = q = name;
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-			// If not in POSIX mode expand macros in the name.
-			if (!POSIX_2017) {
-				char *expname = expand_macros(name, FALSE);
-				free(name);
-				name = expname;
-			} else
+		// If not in POSIX mode expand macros in the name.
+		if (!POSIX_2017) {
+			if (strchr(name, '$'))
+				pp->tp_name = compile_tmpl(name, FALSE);
+		} else
 #endif
+		{
 			// Skip over nested expansions in name
+			char *p, *q;
+
+			p = q = name;
 			do {
 				*q++ = *p;
 			} while ((p = skip_macro(p + 1)) && *p);
+		}
+		if (!pp->tp_name)
+			pp->tp_modifier = get_modifier(name);
+		pp->tp_text = name;
+		pp++;
+	}
+	if (text && *text) {
+		pp->tp_type = TP_TEXT;
+		pp->tp_text = text;
+		pp->tp_len = strlen(text);
+		pp++;
+	}
+	tp->t_count = pp - tp->t_part;
+	return tp;
+}
 
-			// The internal macros support 'D' and 'F' modifiers
-			modifier = '\0';
-			switch (name[0]) {
+void
+free_tmpl(struct tmpl *tp)
+{
+	int i;
+
+	if (tp) {
+		for (i = 0; i < tp->t_count; i++) {
+			free_tmpl(tp->t_part[i].tp_name);
+			free_tmpl(tp->t_part[i].tp_subst);
+		}
+		free(tp->t_str);
+		free(tp);
+	}
+}
+
+/*
+ * Return the compiled form of a string, compiling it again if it's
+ * missing or options have changed since.
+ */
+static struct tmpl *
+get_tmpl(struct tmpl **tpp, const char *str, int except_dollar)
+{
+	if (*tpp == NULL || (*tpp)->t_mode != tmpl_mode(except_dollar)) {
+		free_tmpl(*tpp);
+		*tpp = compile_tmpl(str, except_dollar);
+	}
+	return *tpp;
+}
+
+static void expand_tmpl(struct tmpl *tp, struct strbuf *sb);
+
+// Properties of an expansion
+#define MEMO_AUTO	0x01	// Internal macros were used
+#define MEMO_MAKE	0x02	// $(MAKE) was used
+
+static uint8_t memo_flags;	// Properties of current expansion
+
+static int
+memo_mode(void)
+{
+	return tmpl_mode(FALSE)
+			IF_FEATURE_MAKE_EXTENSIONS(| (posix << 2) | (pragma << 3));
+}
+
+/*
+ * Return TRUE if the saved expansion of a macro can be used:  no
+ * macros it might depend on have been set since it was expanded.
+ */
+static int
+memo_valid(struct macro *mp)
+{
+	return mp->m_cache && mp->m_gen == macrogen &&
+			mp->m_mode == memo_mode() &&
+			(!(mp->m_memo & MEMO_AUTO) || mp->m_autogen == autogen);
+}
+
+/*
+ * Expand a macro given its name and the text following ':', if any.
+ * The expansion is appended to a buffer.
+ */
+static void
+expand_macro(char *name, char modifier, char *find, struct strbuf *sb)
+{
+	char *expfind, *replace, *find_suff, *repl_suff;
+	size_t start = sb->sb_len;
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-			case '^':
-			case '+':
-				if (POSIX_2017)
-					break;
-				// fall through
+	char *find_pref = NULL, *repl_pref = NULL;
+#endif
+	size_t lenf, lenr;
+	struct macro *mp;
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+	struct timespec t0, t1;
 #endif
-			case '@': case '%': case '?': case '<': case '*':
-				if ((name[1] == 'D' || name[1] == 'F') && name[2] == '\0') {
-					modifier = name[1];
-					name[1] = '\0';
-				}
-				break;
-			}
 
-			modified = NULL;
-			if ((mp = getmp(name)))  {
-				// Recursive expansion
-				if (mp->m_flag)
-					error("recursive macro %s", name);
+	// Only do suffix replacement or pattern macro expansion
+	// if both ':' and '=' are found, plus a '%' for the latter.
+	// Suffix replacement is indicated by
+	// find_pref == NULL && (lenf != 0 || lenr != 0);
+	// pattern macro expansion by find_pref != NULL.
+	expfind = find;
+	find_suff = repl_suff = NULL;
+	lenf = lenr = 0;
+	if (find && (replace = find_char(expfind, '='))) {
+		*replace++ = '\0';
+		lenf = strlen(expfind);
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-				// Note if we've expanded $(MAKE)
-				if (strcmp(name, "MAKE") == 0)
-					opts |= OPT_make;
+		if (!POSIX_2017 && (find_suff = strchr(expfind, '%'))) {
+			find_pref = expfind;
+			repl_pref = replace;
+			*find_suff++ = '\0';
+			if ((repl_suff = strchr(replace, '%')))
+				*repl_suff++ = '\0';
+		} else
 #endif
-				mp->m_flag = TRUE;
-				expval = expand_macros(mp->m_val, FALSE);
-				mp->m_flag = FALSE;
-				modified = modify_words(expval, modifier, lenf, lenr,
-								find_pref, repl_pref, find_suff, repl_suff);
-				if (modified)
-					free(expval);
-				else
-					modified = expval;
-			}
-			free(name);
-			free(expfind);
-
-			if (modified && *modified) {
-				// The text to be replaced by the macro expansion is
-				// from s to t inclusive.
-				*s = '\0';
-				newexp = xconcat3(exp, modified, t + 1);
-				t = newexp + (s - exp) + strlen(modified) - 1;
-				free(exp);
-				exp = newexp;
-			} else {
-				// Macro wasn't expanded or expanded to nothing.
-				// Close the space occupied by the macro reference.
-				q = t + 1;
-				t = s - 1;
-				while ((*s++ = *q++))
-					continue;
+		{
+			if (IF_FEATURE_MAKE_EXTENSIONS(posix &&
+						!(pragma & P_EMPTY_SUFFIX) &&)
+					lenf == 0)
+				error("empty suffix%s",
+					!ENABLE_FEATURE_MAKE_EXTENSIONS ? "" :
+						": allow with pragma empty_suffix");
+			find_suff = expfind;
+			repl_suff = replace;
+			lenr = strlen(repl_suff);
+		}
+	}
+
+	if (name[0] && name[1] == '\0' && strchr("@%?<*^+", name[0]))
+		memo_flags |= MEMO_AUTO;
+	if ((mp = getmp(name)) == NULL)
+		return;
+
+	// Recursive expansion
+	if (mp->m_flag)
+		error("recursive macro %s", name);
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+	if (macrostats)
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+#endif
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	// Note if we've expanded $(MAKE)
+	if (strcmp(name, "MAKE") == 0) {
+		opts |= OPT_make;
+		memo_flags |= MEMO_MAKE;
+	}
+#endif
+	if (memo_valid(mp)) {
+		sb_append(sb, mp->m_cache, strlen(mp->m_cache));
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+		if ((mp->m_memo & MEMO_MAKE))
+			opts |= OPT_make;
+#endif
+		memo_flags |= mp->m_memo;
+	} else {
+		uint8_t outer = memo_flags;
+
+		memo_flags = 0;
+		mp->m_flag = TRUE;
+		expand_tmpl(get_tmpl(&mp->m_tmpl, mp->m_val, FALSE), sb);
+		mp->m_flag = FALSE;
+		if (!nomemo) {
+			// Save the expansion for reuse
+			free(mp->m_cache);
+			mp->m_cache = sb->sb_len == start ? xstrdup("") :
+							xstrdup(sb->sb_buf + start);
+			mp->m_gen = macrogen;
+			mp->m_autogen = autogen;
+			mp->m_mode = memo_mode();
+			mp->m_memo = memo_flags;
+		}
+		memo_flags |= outer;
+	}
+
+	// The expansion is modified in place, if necessary.  It's copied
+	// to a buffer which is kept for reuse.
+	if (sb->sb_len != start && (modifier || lenf != 0 || lenr != 0)) {
+		static struct strbuf copy;
+
+		copy.sb_len = 0;
+		sb_append(&copy, sb->sb_buf + start, sb->sb_len - start);
+		sb->sb_len = start;
+		modify_words(sb, copy.sb_buf, modifier, lenf, lenr,
+						find_pref, repl_pref, find_suff, repl_suff);
+	}
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+	if (macrostats) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		mp->m_count++;
+		mp->m_bytes += sb->sb_len - start;
+		mp->m_nsec += (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+						t1.tv_nsec - t0.tv_nsec;
+	}
+#endif
+}
+
+/*
+ * Expand a compiled string to an allocated string.
+ */
+static char *
+tmpl_string(struct tmpl *tp)
+{
+	struct strbuf sb = {0};
+
+	expand_tmpl(tp, &sb);
+	return sb.sb_buf ? sb.sb_buf : xstrdup("");
+}
+
+/*
+ * Expand a compiled string, appending the result to a buffer.  Macros
+ * are expanded directly into the buffer in a single pass.
+ */
+static void
+expand_tmpl(struct tmpl *tp, struct strbuf *sb)
+{
+	struct tpart *pp;
+	char *name, *expname, *find;
+	char modifier;
+	int i;
+
+	for (i = 0; i < tp->t_count; i++) {
+		pp = &tp->t_part[i];
+		switch (pp->tp_type) {
+		case TP_TEXT:
+			sb_append(sb, pp->tp_text, pp->tp_len);
+			break;
+		case TP_UNTERM:
+			error("unterminated variable '%s'", pp->tp_text);
+		case TP_MACRO:
+			find = pp->tp_subst ? tmpl_string(pp->tp_subst) : NULL;
+			name = (char *)pp->tp_text;
+			modifier = pp->tp_modifier;
+			expname = NULL;
+			if (pp->tp_name) {
+				name = expname = tmpl_string(pp->tp_name);
+				modifier = get_modifier(name);
 			}
-			free(modified);
+			expand_macro(name, modifier, find, sb);
+			free(expname);
+			free(find);
+			break;
 		}
 	}
+}
+
+/*
+ * Recursively expand any macros in str to an allocated string.
+ */
+char *
+expand_macros(const char *str, int except_dollar)
+{
+	struct tmpl *tp;
+	char *exp;
+
+#if !ENABLE_FEATURE_MAKE_POSIX_2024
+	int except_dollar = FALSE;
+#endif
+	// Most lines of a makefile have nothing to expand
+	if (strchr(str, '$') == NULL)
+		return xstrdup(str);
+
+	tp = compile_tmpl(str, except_dollar);
+	exp = tmpl_string(tp);
+	free_tmpl(tp);
 	return exp;
 }
 
+/*
+ * Expand the macros in a command.  Its compiled form is kept with it
+ * so the commands of inference rules are only parsed once.
+ */
+char *
+expand_command(struct cmd *cp)
+{
+	return tmpl_string(get_tmpl(&cp->c_tmpl, cp->c_cmd, FALSE));
+}
+
+/*
+ * Return the internal macros referenced by a string, either directly
+ * or through other macros, as a mask of A_* values.  If a macro name
+ * is itself the result of an expansion assume they're all used.
+ */
+static int
+scan_macros(const char *str)
+{
+	const char *s, *end;
+	char *name, *colon;
+	struct macro *mp;
+	int mask = 0;
+
+	for (s = str; mask != A_ALL && (s = strchr(s, '$')) && s[1]; ) {
+		if (s[1] == '$') {
+			// An escaped dollar isn't a macro reference
+			s += 2;
+			continue;
+		} else if (s[1] == '(' || s[1] == '{') {
+			end = find_char(s + 1, s[1] == '(' ? ')' : '}');
+			if (end == NULL)
+				return A_ALL;
+			name = xstrndup(s + 2, end - s - 2);
+			s = end + 1;
+		} else {
+			name = xstrndup(s + 1, 1);
+			s += 2;
+		}
+
+		// Macros may be used in the replacement of $(VAR:.s1=.s2)
+		if ((colon = find_char(name, ':'))) {
+			*colon++ = '\0';
+			mask |= scan_macros(colon);
+		}
+
+		if (strchr(name, '$')) {
+			mask = A_ALL;
+		} else if (name[0] && (name[1] == '\0' ||
+				((name[1] == 'D' || name[1] == 'F') && name[2] == '\0')) &&
+				(end = strchr("@%?<*+^", name[0]))) {
+			// Characters are in the order of the A_* values
+			mask |= 1 << (end - "@%?<*+^");
+		} else if ((mp = getmp(name)) && !mp->m_flag) {
+			mp->m_flag = TRUE;
+			mask |= scan_macros(mp->m_val);
+			mp->m_flag = FALSE;
+		}
+		free(name);
+	}
+	return mask;
+}
+
+/*
+ * Return the internal macros which expanding a list of commands may
+ * require.  The result is cached in the first command, unless makefiles
+ * are still being read and macros may change.
+ */
+int
+auto_macros(struct cmd *cp)
+{
+	struct cmd *cp1;
+	int mask = 0;
+
+	if (doinclude)
+		return A_ALL;
+	if (cp == NULL)
+		return 0;
+	if (!(cp->c_auto & A_SCANNED)) {
+		for (cp1 = cp; cp1 && mask != A_ALL; cp1 = cp1->c_next)
+			mask |= scan_macros(cp1->c_cmd);
+		cp->c_auto = mask | A_SCANNED;
+	}
+	return cp->c_auto & A_ALL;
+}
+
 /*
  * Process a non-command line
  */
@@ -563,13 +917,97 @@ skip_line(const char *str1)
 #endif
 
 /*
- * If fd is NULL read the built-in rules.  Otherwise read from the
- * specified file descriptor.
+ * Makefiles are read a block at a time, or mapped into memory if
+ * they're regular files, and split into lines without copying them
+ * through a line-sized buffer.
  */
-static char *
-make_fgets(char *s, int size, FILE *fd)
+struct reader {
+	FILE *r_fd;			// File being read, NULL for built-in rules
+	char *r_buf;		// Text read from file
+	char *r_pos;		// Start of unread text
+	char *r_end;		// End of text
+	size_t r_size;		// Size of buffer, 0 if file is mapped
+	bool r_eof;			// No more text can be read
+};
+
+#define READ_BLOCK 65536
+
+/*
+ * Prepare to read from a file.  If fd is NULL the built-in rules are
+ * read.
+ */
+static void
+open_reader(struct reader *rd, FILE *fd)
 {
-	return fd ? fgets(s, size, fd) : getrules(s, size);
+#if !defined(_WIN32) && !defined(_WIN64)
+	struct stat info;
+	void *map;
+#endif
+
+	rd->r_fd = fd;
+	rd->r_buf = rd->r_pos = rd->r_end = NULL;
+	rd->r_size = 0;
+	rd->r_eof = FALSE;
+#if !defined(_WIN32) && !defined(_WIN64)
+	if (fd && fstat(fileno(fd), &info) == 0 && S_ISREG(info.st_mode) &&
+			info.st_size > 0 && (uintmax_t)info.st_size <= SIZE_MAX &&
+			ftello(fd) == 0) {
+		map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE,
+					fileno(fd), 0);
+		if (map != MAP_FAILED) {
+			rd->r_buf = rd->r_pos = map;
+			rd->r_end = rd->r_buf + info.st_size;
+			rd->r_eof = TRUE;
+		}
+	}
+#endif
+}
+
+static void
+close_reader(struct reader *rd)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	if (rd->r_size == 0) {
+		if (rd->r_buf)
+			munmap(rd->r_buf, rd->r_end - rd->r_buf);
+		return;
+	}
+#endif
+	free(rd->r_buf);
+}
+
+/*
+ * Add more text to the buffer, moving unread text to the start and
+ * growing the buffer if necessary.  Return FALSE at end of file.
+ */
+static int
+fill_reader(struct reader *rd)
+{
+	size_t len, n;
+
+	if (rd->r_eof)
+		return FALSE;
+
+	len = rd->r_end - rd->r_pos;
+	if (len && rd->r_pos != rd->r_buf)
+		memmove(rd->r_buf, rd->r_pos, len);
+	if (rd->r_size - len < READ_BLOCK) {
+		rd->r_size = MAX(2 * rd->r_size, len + READ_BLOCK);
+		rd->r_buf = xrealloc(rd->r_buf, rd->r_size);
+	}
+
+	if (rd->r_fd) {
+		n = fread(rd->r_buf + len, 1, rd->r_size - len, rd->r_fd);
+	} else {
+		// Built-in rules are supplied a line at a time
+		n = getrules(rd->r_buf + len, READ_BLOCK) ?
+				strlen(rd->r_buf + len) : 0;
+	}
+	rd->r_pos = rd->r_buf;
+	rd->r_end = rd->r_buf + len + n;
+	if (n == 0)
+		rd->r_eof = TRUE;
+	return n != 0;
 }
 
 /*
@@ -578,44 +1016,69 @@ make_fgets(char *s, int size, FILE *fd)
  * Ignore comment lines.  Return NULL on EOF.
  */
 static char *
-readline(FILE *fd, int want_command)
+readline(struct reader *rd, int want_command)
 {
-	char *p, *str = NULL;
-	int pos = 0;
-	int len = 0;
+	char *p, *s, *nl, *str;
+	size_t off, len;
+	bool cr;
 
 	for (;;) {
-		// We need room for at least one character and a NUL terminator
-		if (len - pos > 1 &&
-				make_fgets(str + pos, len - pos, fd) == NULL) {
-			if (pos)
-				return str;
-			free(str);
-			return NULL;	// EOF
-		}
+		// Find the end of the line.  Only offsets from the start of
+		// unread text are kept, as filling the buffer may move it.
+		off = 0;
+		cr = FALSE;
+		for (;;) {
+			// The buffer may be empty, with no memory allocated
+			s = rd->r_pos ? rd->r_pos + off : NULL;
+			nl = rd->r_end > s ? memchr(s, '\n', rd->r_end - s) : NULL;
+			if (nl == NULL) {
+				if (fill_reader(rd))
+					continue;
+				if (rd->r_pos == rd->r_end)
+					return NULL;	// EOF
+				// Last line has no newline
+				if (s != rd->r_end)
+					lineno++;
+				off = rd->r_end - rd->r_pos;
+				break;
+			}
+			off = nl - rd->r_pos + 1;
+			lineno++;
 
-		if (len - pos < 2 || (p = strchr(str + pos, '\n')) == NULL) {
-			// Need more room
-			if (len)
-				pos = len - 1;
-			len += 256;
-			str = xrealloc(str, len);
-			continue;
-		}
-		lineno++;
+			// Remove CR before LF
+			if (nl != s && nl[-1] == '\r') {
+				cr = TRUE;
+				nl--;
+			}
 
-		// Remove CR before LF
-		if (p != str && p[-1] == '\r') {
-			p[-1] = '\n';
-			*p-- = '\0';
+			// Keep going if newline has been escaped
+			if (nl == s || nl[-1] != '\\')
+				break;
 		}
+		dispno = lineno;
 
-		// Keep going if newline has been escaped
-		if (p != str && p[-1] == '\\') {
-			pos = (int)(p - str + 1);
-			continue;
+		str = xmalloc(off + 1);
+		if (!cr) {
+			memcpy(str, rd->r_pos, off);
+			str[off] = '\0';
+		} else {
+			for (p = str, s = rd->r_pos; s != rd->r_pos + off; s = nl + 1) {
+				nl = memchr(s, '\n', rd->r_pos + off - s);
+				if (nl == NULL) {
+					memcpy(p, s, rd->r_pos + off - s);
+					p += rd->r_pos + off - s;
+					break;
+				}
+				len = nl - s;
+				if (len && s[len - 1] == '\r')
+					len--;
+				memcpy(p, s, len);
+				p += len;
+				*p++ = '\n';
+			}
+			*p = '\0';
 		}
-		dispno = lineno;
+		rd->r_pos += off;
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 		// Check for lines that are conditionally skipped.
@@ -631,14 +1094,13 @@ readline(FILE *fd, int want_command)
 				p++;
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-			if (*p != '\n' && (posix ? *str != '#' : *p != '#'))
+			if (*p != '\n' && *p != '\0' && (posix ? *str != '#' : *p != '#'))
 #else
-			if (*p != '\n' && *str != '#')
+			if (*p != '\n' && *p != '\0' && *str != '#')
 #endif
 				return str;
 		}
-
-		pos = 0;
+		free(str);
 	}
 }
 
@@ -694,6 +1156,7 @@ target_type(char *s)
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 		".PRAGMA",
+		".ONESHELL",
 #endif
 	};
 
@@ -711,6 +1174,7 @@ target_type(char *s)
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 		T_SPECIAL,
+		T_SPECIAL,
 #endif
 	};
 
@@ -722,6 +1186,12 @@ target_type(char *s)
 		if (strcmp(s_name[ret], s) == 0)
 			return s_type[ret];
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	// Check for a job pool
+	if (strncmp(s, ".POOL.", 6) == 0 && s[6] != '\0')
+		return T_SPECIAL;
+#endif
+
 	// Check for an inference rule
 	ret = T_NORMAL;
 	sfx = suffix(s);
@@ -811,6 +1281,214 @@ process_command(char *s)
 	return s;
 }
 
+#if ENABLE_FEATURE_MAKE_SHELL_CACHE
+/*
+ * Saved results of '!=' assignments.  A result remains valid while
+ * the inputs declared by the makefile are unchanged.
+ */
+struct shcache {
+	struct shcache *s_next;
+	char *s_cmd;		// Expanded command
+	char *s_key;		// State of declared inputs, NULL if not run
+	char *s_out;		// Output of command
+	size_t s_len;		// Length of output
+};
+
+static struct shcache *shcache;
+static char *shcachefile;
+static bool shcacheread;
+static bool shcachedirty;
+
+/*
+ * Read the results saved by earlier runs.  Each entry is a line
+ * giving the lengths of the command, key and output, followed by
+ * their text and a newline.  The results are also saved on exit, so
+ * they aren't lost if an error stops make while makefiles are read.
+ */
+static void
+load_shell_cache(void)
+{
+	FILE *fp;
+	struct shcache *sp, **spp;
+	size_t clen, klen, olen;
+
+	shcacheread = TRUE;
+	shcachefile = getenv("PDPMAKE_SHELLCACHE");
+	if (shcachefile == NULL || *shcachefile == '\0') {
+		shcachefile = NULL;
+		return;
+	}
+	atexit(save_shell_cache);
+	if ((fp = fopen(shcachefile, "r")) == NULL)
+		return;
+
+	spp = &shcache;
+	while (fscanf(fp, "%zu %zu %zu", &clen, &klen, &olen) == 3 &&
+			getc(fp) == '\n') {
+		sp = xmalloc(sizeof(struct shcache));
+		sp->s_cmd = xmalloc(clen + 1);
+		sp->s_key = xmalloc(klen + 1);
+		sp->s_out = xmalloc(olen + 1);
+		sp->s_len = olen;
+		if (fread(sp->s_cmd, 1, clen, fp) != clen ||
+				fread(sp->s_key, 1, klen, fp) != klen ||
+				fread(sp->s_out, 1, olen, fp) != olen ||
+				getc(fp) != '\n') {
+			free(sp->s_cmd);
+			free(sp->s_key);
+			free(sp->s_out);
+			free(sp);
+			break;
+		}
+		sp->s_cmd[clen] = sp->s_key[klen] = sp->s_out[olen] = '\0';
+		sp->s_next = NULL;
+		*spp = sp;
+		spp = &sp->s_next;
+	}
+	fclose(fp);
+}
+
+/*
+ * Describe the state of the files listed in the .SHELLFILES macro
+ * and the environment variables listed in .SHELLENV.  The current
+ * directory and the makefile are included, as the same command may
+ * give different results elsewhere.  NULL is returned if the result
+ * of a command shouldn't be cached:  there's no cache file or the
+ * makefile hasn't declared the inputs.
+ */
+static char *
+shell_cache_key(void)
+{
+	struct strbuf sb = {NULL, 0, 0};
+	struct stat info;
+	char *list, *p, *word, *val, buf[80];
+
+	if (!shcacheread)
+		load_shell_cache();
+	if (!shcachefile || posix ||
+			(!getmp(".SHELLFILES") && !getmp(".SHELLENV")))
+		return NULL;
+
+	sb_append(&sb, "", 0);
+	for (int i = 0; i < 2; i++) {
+		p = i ? (char *)makefile : ".";
+		if (p == NULL)
+			continue;
+		if ((val = realpath(p, NULL)) == NULL)
+			val = xstrdup(p);
+		sb_append(&sb, i ? "m " : "d ", 2);
+		sb_append(&sb, val, strlen(val));
+		sb_append(&sb, "\n", 1);
+		free(val);
+	}
+
+	p = list = expand_macros("$(.SHELLFILES)", FALSE);
+	while ((word = gettok(&p)) != NULL) {
+		sb_append(&sb, "f ", 2);
+		sb_append(&sb, word, strlen(word));
+		if (stat(word, &info) == 0)
+			snprintf(buf, sizeof(buf), " %lld.%09ld %lld\n",
+						(long long)info.st_mtim.tv_sec,
+						(long)info.st_mtim.tv_nsec,
+						(long long)info.st_size);
+		else
+			strcpy(buf, " -\n");
+		sb_append(&sb, buf, strlen(buf));
+	}
+	free(list);
+
+	p = list = expand_macros("$(.SHELLENV)", FALSE);
+	while ((word = gettok(&p)) != NULL) {
+		sb_append(&sb, "e ", 2);
+		sb_append(&sb, word, strlen(word));
+		if ((val = getenv(word)) != NULL) {
+			sb_append(&sb, "=", 1);
+			sb_append(&sb, val, strlen(val));
+		}
+		sb_append(&sb, "\n", 1);
+	}
+	free(list);
+	return sb.sb_buf;
+}
+
+/*
+ * Find the cache entry for a command, adding one if necessary.
+ */
+static struct shcache *
+shell_cache_find(const char *cmd)
+{
+	struct shcache *sp;
+
+	for (sp = shcache; sp; sp = sp->s_next) {
+		if (strcmp(sp->s_cmd, cmd) == 0)
+			return sp;
+	}
+	sp = xmalloc(sizeof(struct shcache));
+	sp->s_cmd = xstrdup(cmd);
+	sp->s_key = sp->s_out = NULL;
+	sp->s_len = 0;
+	sp->s_next = shcache;
+	shcache = sp;
+	return sp;
+}
+
+/*
+ * Record the output of a command.  The entry takes ownership of key.
+ */
+static void
+shell_cache_store(struct shcache *sp, char *key, const char *out, size_t len)
+{
+	free(sp->s_key);
+	free(sp->s_out);
+	sp->s_key = key;
+	sp->s_out = xmalloc(len + 1);
+	memcpy(sp->s_out, out, len);
+	sp->s_out[len] = '\0';
+	sp->s_len = len;
+	shcachedirty = TRUE;
+}
+
+/*
+ * Write the cache file, if it's changed, and free the cache.  Results
+ * are only needed while makefiles are read.
+ */
+void
+save_shell_cache(void)
+{
+	FILE *fp;
+	char *tmp;
+	struct shcache *sp, *next;
+
+	if (shcachedirty) {
+		tmp = xconcat3(shcachefile, ".tmp", "");
+		if ((fp = fopen(tmp, "w")) != NULL) {
+			for (sp = shcache; sp; sp = sp->s_next) {
+				if (sp->s_key == NULL)
+					continue;
+				fprintf(fp, "%zu %zu %zu\n%s%s", strlen(sp->s_cmd),
+						strlen(sp->s_key), sp->s_len,
+						sp->s_cmd, sp->s_key);
+				fwrite(sp->s_out, 1, sp->s_len, fp);
+				putc('\n', fp);
+			}
+			if (fclose(fp) != 0 || rename(tmp, shcachefile) != 0)
+				unlink(tmp);
+		}
+		free(tmp);
+		shcachedirty = FALSE;
+	}
+
+	for (sp = shcache; sp; sp = next) {
+		next = sp->s_next;
+		free(sp->s_cmd);
+		free(sp->s_key);
+		free(sp->s_out);
+		free(sp);
+	}
+	shcache = NULL;
+}
+#endif
+
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 static char *
 run_command(const char *cmd)
@@ -819,12 +1497,34 @@ run_command(const char *cmd)
 	char *s, *val = NULL;
 	char buf[256];
 	size_t len = 0, nread;
+#if ENABLE_FEATURE_MAKE_SHELL_CACHE
+	struct shcache *sp = NULL;
+	char *key = shell_cache_key();
+
+	if (key) {
+		sp = shell_cache_find(cmd);
+		if (sp->s_key && strcmp(sp->s_key, key) == 0) {
+			// Inputs are unchanged, reuse the saved output
+			free(key);
+			if (sp->s_len == 0)
+				return NULL;
+			len = sp->s_len;
+			val = xmalloc(len + 1);
+			memcpy(val, sp->s_out, len + 1);
+			goto got_output;
+		}
+	}
+#endif
     #if defined(_WIN32) || defined(_WIN64)
 	if ((fd = _popen(cmd, "r")) == NULL)
 		return val;
     #else
-	if ((fd = popen(cmd, "r")) == NULL)
+	if ((fd = popen(cmd, "r")) == NULL) {
+# if ENABLE_FEATURE_MAKE_SHELL_CACHE
+		free(key);
+# endif
 		return val;
+	}
     #endif
 	for (;;) {
 		nread = fread(buf, 1, sizeof(buf), fd);
@@ -838,12 +1538,22 @@ run_command(const char *cmd)
 	}
     #if defined(_WIN32) || defined(_WIN64)
     _pclose(fd);
+    #elif ENABLE_FEATURE_MAKE_SHELL_CACHE
+	// Only save the output of commands which succeed
+	if (pclose(fd) == 0 && key)
+		shell_cache_store(sp, key, val ? val : "", len);
+	else
+		free(key);
     #else
     pclose(fd);
     #endif
 	if (val == NULL)
 		return val;
 
+#if ENABLE_FEATURE_MAKE_SHELL_CACHE
+ got_output:
+#endif
+
 	// Strip leading whitespace in POSIX 2024 mode
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 	if (posix)
@@ -956,8 +1666,8 @@ input(FILE *fd, int ilevel)
 	char *p, *q, *s, *a, *str, *expanded, *copy;
 	char *str1, *str2;
 	struct name *np;
-	struct depend *dp;
-	struct cmd *cp;
+	struct depend *dp, **dpp;
+	struct cmd *cp, **cpp;
 	int startno, count;
 	bool semicolon_cmd, seen_inference;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -975,9 +1685,11 @@ input(FILE *fd, int ilevel)
 #else
 	const bool minus = FALSE;
 #endif
+	struct reader rd;
 
+	open_reader(&rd, fd);
 	lineno = 0;
-	str1 = readline(fd, FALSE);
+	str1 = readline(&rd, FALSE);
 	while (str1) {
 		str2 = NULL;
 
@@ -1208,12 +1920,13 @@ input(FILE *fd, int ilevel)
 
 		// Look for semicolon separator
 		cp = NULL;
+		cpp = &cp;
 		s = strchr(q, ';');
 		if (s) {
 			// Retrieve command from expanded copy of line
 			char *copy3 = expand_macros(copy, FALSE);
 			if ((p = find_colon(copy3)) && (p = strchr(p, ';')))
-				cp = newcmd(process_command(p + 1), cp);
+				cpp = newcmd(process_command(p + 1), cpp);
 			free(copy3);
 			*s = '\0';
 		}
@@ -1221,14 +1934,15 @@ input(FILE *fd, int ilevel)
 
 		// Create list of prerequisites
 		dp = NULL;
+		dpp = &dp;
 		while (((p = gettok(&q)) != NULL)) {
 #if !ENABLE_FEATURE_MAKE_EXTENSIONS
+			np = newname(p);
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 			if (!POSIX_2017 && strcmp(p, ".WAIT") == 0)
-				continue;
+				np->n_flag |= N_WAIT;
 # endif
-			np = newname(p);
-			dp = newdep(np, dp);
+			dpp = newdep(np, dpp);
 #else
 			char *newp = NULL;
 
@@ -1267,12 +1981,12 @@ input(FILE *fd, int ilevel)
 				files = gd.gl_pathv;
 			}
 			for (i = 0; i < nfile; ++i) {
+				np = newname(files[i]);
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 				if (!POSIX_2017 && strcmp(files[i], ".WAIT") == 0)
-					continue;
+					np->n_flag |= N_WAIT;
 # endif
-				np = newname(files[i]);
-				dp = newdep(np, dp);
+				dpp = newdep(np, dpp);
 			}
 			if (files != &p)
 				globfree(&gd);
@@ -1285,8 +1999,8 @@ input(FILE *fd, int ilevel)
 
 		// Create list of commands
 		startno = dispno;
-		while ((str2 = readline(fd, TRUE)) && *str2 == '\t') {
-			cp = newcmd(process_command(str2), cp);
+		while ((str2 = readline(&rd, TRUE)) && *str2 == '\t') {
+			cpp = newcmd(process_command(str2), cpp);
 			free(str2);
 		}
 		dispno = startno;
@@ -1363,7 +2077,7 @@ input(FILE *fd, int ilevel)
  end_loop:
 		free(str1);
 		dispno = lineno;
-		str1 = str2 ? str2 : readline(fd, FALSE);
+		str1 = str2 ? str2 : readline(&rd, FALSE);
 		free(copy);
 		free(expanded);
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -1383,4 +2097,5 @@ input(FILE *fd, int ilevel)
 	if (clevel != old_clevel)
 		error("invalid conditional");
 #endif
+	close_reader(&rd);
 }
@@ -0,0 +1,2105 @@
+/*
+ * Run the commands to make targets, possibly in parallel
+ */
+#include "make.h"
+
+// A command line with its macros expanded, ready to be executed
+struct jobcmd {
+	struct jobcmd *jc_next;	// Next command line
+	char *jc_cmd;			// Text of command, prefixes removed
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	char *jc_echo;			// Text to echo, if not jc_cmd
+#endif
+	const char *jc_makefile;	// Makefile in which command was defined
+	int jc_dispno;			// Line number within makefile
+	uint8_t jc_flag;		// How to run the command
+};
+
+#define JC_SILENT	0x01	// Don't echo command
+#define JC_IGNORE	0x02	// Ignore errors
+#define JC_EXECUTE	0x04	// Execute command
+#define JC_PLUS		0x08	// Execute even with -q ('+' prefix)
+#define JC_MAKE		0x10	// Recursive invocation of make
+
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+// Output collected from the commands of a job
+struct output {
+	char *o_buf;			// Output not yet written
+	size_t o_len;			// Length of output
+	size_t o_size;			// Size of buffer
+	int o_fd;				// Pipe from current command, or -1
+};
+#endif
+
+// The commands to make a target
+struct job {
+	struct job *j_next;		// Next job in list
+	struct name *j_name;	// Target being made
+	struct jobcmd *j_cmd;	// Commands not yet completed
+	pid_t j_pid;			// Process running current command
+	int j_estat;			// Status of job
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	struct timespec j_start;	// When the first command was started
+#endif
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+	struct output j_out[2];	// Collected standard output and error
+#endif
+#if ENABLE_FEATURE_MAKE_RUSAGE
+	struct timespec j_cmdstart;	// When the current command was started
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct pool *j_pool;	// Pool the job belongs to, if any
+#endif
+#if ENABLE_FEATURE_MAKE_COSHELL
+	struct coproc *j_coproc;	// Shell running the current command
+#endif
+};
+
+#if ENABLE_FEATURE_MAKE_COSHELL
+// A long-lived shell to which commands are sent
+struct coproc {
+	struct coproc *cp_next;
+	pid_t cp_pid;
+	int cp_cmdfd;			// Commands are written here
+	int cp_statfd;			// Exit status of each command is read here
+	size_t cp_len;			// Length of status read so far
+	char cp_buf[32];
+};
+
+// Signals which a shell reports by name
+static const struct {
+	const char *name;
+	int num;
+} signames[] = {
+	{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"ILL", SIGILL},
+	{"TRAP", SIGTRAP}, {"ABRT", SIGABRT}, {"BUS", SIGBUS}, {"FPE", SIGFPE},
+	{"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"SEGV", SIGSEGV},
+	{"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+	{"TERM", SIGTERM}, {"XCPU", SIGXCPU}, {"XFSZ", SIGXFSZ}, {"SYS", SIGSYS}
+};
+#endif
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+struct pool {
+	struct name *p_name;	// Special target listing the pool's members
+	int p_depth;			// Maximum number of jobs to run at once
+	int p_running;			// Number of jobs running
+};
+#endif
+
+int maxjobs = 1;			// Maximum number of jobs to run in parallel
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+int outsync;				// How output from parallel jobs is collected
+double loadlimit;			// Don't start jobs above this load average
+bool oneshell;				// Run all lines of a recipe in one shell
+static double recentjobs;	// Jobs not yet reflected in load average
+static struct timespec loadtime;	// When recentjobs was last updated
+#endif
+static struct job *queuehead;	// Jobs waiting to start
+static struct job *queuelast;	// Last job in queue
+static struct job *running;	// Jobs which have started
+static int nrunning;		// Number of jobs in running list
+static int nchild;			// Number of child processes
+static bool stopping;		// A command failed: wait for others and exit
+#if !defined(_WIN32) && !defined(_WIN64)
+static struct sigaction old_int, old_quit;
+#endif
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+static char *timefile;		// Log of time taken to make targets
+static bool timesdirty;		// Log needs to be updated
+#endif
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+char *jobserver_auth;		// Jobserver details from MAKEFLAGS
+static int js_rfd = -1;		// Jobserver pipe or FIFO
+static int js_wfd = -1;
+static int ntokens;			// Number of jobserver tokens held
+static volatile sig_atomic_t js_dupfd = -1;	// Closed when a child exits
+#endif
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+static int sigfd[2] = {-1, -1};	// Written to when a child exits
+#endif
+#if ENABLE_FEATURE_MAKE_RUSAGE
+static FILE *rusagefile;	// Report of resources used by commands
+#endif
+#if ENABLE_FEATURE_MAKE_PREFETCH
+unsigned long cmdcount;		// Number of commands started
+#endif
+#if ENABLE_FEATURE_MAKE_COSHELL
+bool coshell;				// Send commands to long-lived shells
+static struct coproc *idleshells;	// Shells waiting for a command
+#endif
+
+static void
+remove_name(struct name *np)
+{
+	if (!dryrun && !print && !precious &&
+			!(np->n_flag & (N_PRECIOUS | N_PHONY)) &&
+			unlink(np->n_name) == 0) {
+		diagnostic("'%s' removed", np->n_name);
+	}
+}
+
+/*
+ * Remove the targets of any commands which are running.
+ */
+void
+remove_target(void)
+{
+	struct job *jp;
+
+	for (jp = running; jp; jp = jp->j_next) {
+		if (jp->j_pid)
+			remove_name(jp->j_name);
+	}
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+/*
+ * If make exits while jobs are running in the background, for example
+ * on a fatal error, stop their commands and wait for them.  As when
+ * make is interrupted the targets they were making are removed.
+ */
+static void
+stop_jobs(void)
+{
+	struct job *jp;
+	int status;
+
+	for (jp = running; jp; jp = jp->j_next) {
+		if (jp->j_pid > 0)
+			kill(jp->j_pid, SIGTERM);
+	}
+	for (jp = running; jp; jp = jp->j_next) {
+		if (jp->j_pid > 0) {
+			while (waitpid(jp->j_pid, &status, 0) == -1 && errno == EINTR)
+				;
+			remove_name(jp->j_name);
+		}
+	}
+	running = NULL;
+}
+#endif
+
+/*
+ * Update the modification time of a file to now.
+ */
+static void
+touch(struct name *np)
+{
+	if (dryrun || !silent)
+		printf("touch %s\n", np->n_name);
+
+	if (!dryrun) {
+		const struct timespec timebuf[2] = {{0, UTIME_NOW}, {0, UTIME_NOW}};
+
+		if (utimensat(AT_FDCWD, np->n_name, timebuf, 0) < 0) {
+			if (errno == ENOENT) {
+				int fd = open(np->n_name, O_RDWR | O_CREAT, 0666);
+				if (fd >= 0) {
+					close(fd);
+					return;
+				}
+			}
+			warning("touch %s failed: %s\n", np->n_name, strerror(errno));
+		}
+	}
+}
+
+#if ENABLE_FEATURE_MAKE_JOBSERVER || ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+/*
+ * When a child exits close the descriptor get_token() is reading from.
+ * This interrupts the read even if it's restarted after the signal.
+ * Also wake up wait_output() by writing to a pipe.
+ */
+static void
+sigchld_handler(int sig)
+{
+	int err = errno;
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+	int fd = js_dupfd;
+
+	if (fd >= 0) {
+		js_dupfd = -1;
+		close(fd);
+	}
+#endif
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+	if (sigfd[1] >= 0 && write(sigfd[1], "", 1) < 0) {
+		// The pipe is full: a wakeup is already pending
+	}
+#endif
+	(void)sig;
+	errno = err;
+}
+
+/*
+ * Install the handler for SIGCHLD, if that hasn't already been done.
+ */
+static void
+catch_sigchld(void)
+{
+	static bool caught;
+	struct sigaction sa;
+
+	if (caught)
+		return;
+	caught = TRUE;
+
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+	if (outsync
+# if ENABLE_FEATURE_MAKE_COSHELL
+			|| coshell
+# endif
+			) {
+		if (pipe(sigfd) == -1)
+			error("can't create pipe: %s", strerror(errno));
+		fcntl(sigfd[0], F_SETFD, FD_CLOEXEC);
+		fcntl(sigfd[1], F_SETFD, FD_CLOEXEC);
+		fcntl(sigfd[0], F_SETFL, O_NONBLOCK);
+		fcntl(sigfd[1], F_SETFL, O_NONBLOCK);
+	}
+#endif
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = sigchld_handler;
+	sigaction(SIGCHLD, &sa, NULL);
+}
+
+/*
+ * Return TRUE if a child process has exited and not yet been waited for.
+ */
+static int
+child_exited(void)
+{
+	siginfo_t info;
+
+	info.si_pid = 0;
+	return waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+				info.si_pid != 0;
+}
+#endif
+
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+/*
+ * Append text to the output collected from a job.
+ */
+static void
+add_output(struct output *op, const char *buf, size_t len)
+{
+	if (op->o_len + len > op->o_size) {
+		op->o_size = MAX(op->o_size * 2, op->o_len + len + 256);
+		op->o_buf = xrealloc(op->o_buf, op->o_size);
+	}
+	memcpy(op->o_buf + op->o_len, buf, len);
+	op->o_len += len;
+}
+
+/*
+ * Read whatever output is available from a job's command.  The pipe
+ * is closed at end of file.  The buffer grows as required, so the
+ * command is never left waiting for us to write its output.
+ */
+static void
+read_output(struct output *op)
+{
+	char buf[4096];
+	ssize_t len;
+
+	while (op->o_fd >= 0) {
+		len = read(op->o_fd, buf, sizeof(buf));
+		if (len > 0) {
+			add_output(op, buf, len);
+		} else if (len == 0 || errno != EINTR) {
+			if (len == 0 || errno != EAGAIN) {
+				close(op->o_fd);
+				op->o_fd = -1;
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Collect the last of the output from a job's command after it has
+ * exited.  Any background process it left running loses its output.
+ */
+static void
+end_output(struct job *jp)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		read_output(&jp->j_out[i]);
+		if (jp->j_out[i].o_fd >= 0) {
+			close(jp->j_out[i].o_fd);
+			jp->j_out[i].o_fd = -1;
+		}
+	}
+}
+
+/*
+ * Write the output collected from a job to our standard output and
+ * standard error.
+ */
+static void
+flush_output(struct job *jp)
+{
+	struct output *op;
+	ssize_t len;
+	size_t off;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		op = &jp->j_out[i];
+		if (op->o_len == 0)
+			continue;
+		fflush(i == 0 ? stdout : stderr);
+		for (off = 0; off < op->o_len; off += len) {
+			len = write(i + 1, op->o_buf + off, op->o_len - off);
+			if (len < 0) {
+				if (errno == EINTR) {
+					len = 0;
+					continue;
+				}
+				break;
+			}
+		}
+		op->o_len = 0;
+	}
+}
+
+/*
+ * Wait until a child process has exited, a shell has reported the
+ * status of a command or, if fd isn't -1, until fd can be read.
+ * Meanwhile collect output from the commands of running jobs.  Return
+ * TRUE if fd can be read.
+ */
+static int
+wait_output(int fd)
+{
+	static struct pollfd *pfd;
+	static struct output **out;
+	static size_t size;
+	struct job *jp;
+	size_t n, i;
+	char buf[64];
+	int j;
+
+	for (;;) {
+		if (child_exited())
+			return FALSE;
+
+		if (size < 2 + 3 * (size_t)nrunning) {
+			size = 2 + 3 * (size_t)nrunning;
+			pfd = xrealloc(pfd, size * sizeof(*pfd));
+			out = xrealloc(out, size * sizeof(*out));
+		}
+		n = 0;
+		pfd[n].fd = sigfd[0];
+		pfd[n++].events = POLLIN;
+		if (fd >= 0) {
+			pfd[n].fd = fd;
+			pfd[n++].events = POLLIN;
+		}
+		for (jp = running; jp; jp = jp->j_next) {
+			for (j = 0; j < 2; j++) {
+				if (jp->j_out[j].o_fd >= 0) {
+					out[n] = &jp->j_out[j];
+					pfd[n].fd = jp->j_out[j].o_fd;
+					pfd[n++].events = POLLIN;
+				}
+			}
+#if ENABLE_FEATURE_MAKE_COSHELL
+			if (jp->j_coproc) {
+				out[n] = NULL;
+				pfd[n].fd = jp->j_coproc->cp_statfd;
+				pfd[n++].events = POLLIN;
+			}
+#endif
+		}
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error("poll failed: %s", strerror(errno));
+		}
+
+		while (read(sigfd[0], buf, sizeof(buf)) > 0)
+			;
+		i = 1;
+		if (fd >= 0 && pfd[i++].revents)
+			return TRUE;
+		for (j = 0; i < n; i++) {
+			if (pfd[i].revents) {
+				if (out[i])
+					read_output(out[i]);
+				else
+					j = 1;
+			}
+		}
+		if (j)
+			return FALSE;
+	}
+}
+
+/*
+ * Return TRUE if the output of a job's command should be collected.
+ * That's only necessary if jobs are run in parallel.  A recursive make
+ * is left to collect its own output.
+ */
+static int
+collect_output(struct jobcmd *jc)
+{
+	return outsync && maxjobs > 1 && !doinclude && !(jc->jc_flag & JC_MAKE);
+}
+#endif
+
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+/*
+ * Return jobserver tokens until only 'keep' are held.
+ */
+static void
+put_tokens(int keep)
+{
+	while (ntokens > keep) {
+		if (write(js_wfd, "+", 1) == -1 && errno == EINTR)
+			continue;
+		ntokens--;
+	}
+}
+
+static void
+return_tokens(void)
+{
+	put_tokens(0);
+}
+
+/*
+ * Wait for a token from the jobserver.  Return FALSE without a token
+ * if a child process finishes first.  GNU make may have made the pipe
+ * non-blocking, in which case poll(2) is used to wait.
+ */
+static int
+get_token(void)
+{
+	ssize_t len;
+	char c;
+
+	for (;;) {
+		if (js_dupfd < 0 &&
+				(js_dupfd = fcntl(js_rfd, F_DUPFD_CLOEXEC, 0)) < 0)
+			error("jobserver dup failed: %s", strerror(errno));
+
+		// Don't wait for a token if a child has already finished
+		if (child_exited())
+			return FALSE;
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+		// Keep collecting output from commands while waiting
+		if (sigfd[0] >= 0 && !wait_output(js_dupfd))
+			return FALSE;
+#endif
+
+		len = read(js_dupfd, &c, 1);
+		if (len == 1) {
+			ntokens++;
+			return TRUE;
+		}
+		if (len == -1 && errno == EAGAIN) {
+			struct pollfd pfd = {js_dupfd, POLLIN, 0};
+
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (len == 0 || (errno != EINTR && errno != EBADF))
+			error("jobserver read failed: %s",
+					len == 0 ? "end of file" : strerror(errno));
+	}
+}
+
+/*
+ * Set up the jobserver.  If MAKEFLAGS described one created by a
+ * parent make use it, unless -j was given on the command line.
+ * Otherwise create one if jobs are to be run in parallel.  Details
+ * are added to MAKEFLAGS so recursive invocations of make (including
+ * GNU make) share the same pool of jobs.
+ */
+void
+jobserver_init(int forced)
+{
+	char *auth = NULL, *makeflags;
+	const char *env;
+
+	if (jobserver_auth && forced) {
+		warning("-j forced in recursive make: starting new jobserver");
+	} else if (jobserver_auth) {
+		if (strncmp(jobserver_auth, "fifo:", 5) == 0) {
+			js_rfd = js_wfd = open(jobserver_auth + 5, O_RDWR | O_CLOEXEC);
+		} else if (sscanf(jobserver_auth, "%d,%d", &js_rfd, &js_wfd) == 2 &&
+				fcntl(js_rfd, F_SETFD, FD_CLOEXEC) != -1 &&
+				fcntl(js_wfd, F_SETFD, FD_CLOEXEC) != -1) {
+			// Pipe inherited from parent
+		} else {
+			js_rfd = js_wfd = -1;
+		}
+
+		if (js_rfd < 0) {
+			warning("jobserver unavailable: using -j1.  "
+						"Add '+' to parent make rule.");
+			maxjobs = 1;
+		} else {
+			auth = xconcat3("--jobserver-auth=", jobserver_auth, "");
+		}
+	}
+
+	if (!auth && maxjobs > 1) {
+		int fd[2], i;
+		char buf[64];
+
+		if (pipe(fd) == -1)
+			error("can't create jobserver: %s", strerror(errno));
+		js_rfd = fd[0];
+		js_wfd = fd[1];
+		fcntl(js_rfd, F_SETFD, FD_CLOEXEC);
+		fcntl(js_wfd, F_SETFD, FD_CLOEXEC);
+
+		// Add a token for each job but the first, which doesn't need
+		// one.  Don't block if the pipe can't hold them all.
+		fcntl(js_wfd, F_SETFL, O_NONBLOCK);
+		for (i = 1; i < maxjobs && write(js_wfd, "+", 1) == 1; i++)
+			;
+		fcntl(js_wfd, F_SETFL, 0);
+		maxjobs = i;
+
+		sprintf(buf, "--jobserver-auth=%d,%d", js_rfd, js_wfd);
+		auth = xstrdup(buf);
+	}
+	free(jobserver_auth);
+	jobserver_auth = NULL;
+
+	if (auth) {
+		env = getenv("MAKEFLAGS");
+		makeflags = xappendword(env ? xstrdup(env) : NULL, auth);
+		setmacro("MAKEFLAGS", makeflags, 0);
+		setenv("MAKEFLAGS", makeflags, 1);
+		free(makeflags);
+		free(auth);
+	}
+
+	if (js_rfd >= 0 && maxjobs > 1) {
+		catch_sigchld();
+		atexit(return_tokens);
+	}
+}
+#endif
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS && !defined(_WIN32) && !defined(_WIN64)
+/*
+ * If a command is simple enough to be run without a shell split it
+ * into words and return them as an argv array, else return NULL.
+ * The caller should free argv[0] and argv.  Commands containing shell
+ * metacharacters or starting with a shell builtin, keyword or variable
+ * assignment need the shell.
+ */
+static char **
+split_command(const char *cmd)
+{
+	static const char *builtin[] = {
+		"!", ".", ":", "[", "alias", "bg", "break", "case", "cd",
+		"command", "continue", "do", "done", "echo", "elif", "else",
+		"esac", "eval", "exec", "exit", "export", "fc", "fg", "fi",
+		"for", "getopts", "hash", "if", "jobs", "kill", "local",
+		"newgrp", "printf", "pwd", "read", "readonly", "return", "set",
+		"shift", "source", "test", "then", "times", "trap", "type",
+		"ulimit", "umask", "unalias", "unset", "until", "wait", "while",
+		"{", "}"
+	};
+	char **argv, *s, *word;
+	size_t i, argc;
+
+	if (posix || cmd[strcspn(cmd, "|&;<>()$`\\\"'*?[#~{}\n\r")] != '\0')
+		return NULL;
+
+	s = xstrdup(cmd);
+	argv = xmalloc((strlen(s) / 2 + 2) * sizeof(char *));
+	argc = 0;
+	for (word = strtok(s, " \t"); word; word = strtok(NULL, " \t"))
+		argv[argc++] = word;
+	argv[argc] = NULL;
+
+	// A leading word containing '=' is a variable assignment
+	if (argc && !strchr(argv[0], '=')) {
+		for (i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+			if (strcmp(argv[0], builtin[i]) == 0)
+				break;
+		}
+		if (i == sizeof(builtin) / sizeof(builtin[0]))
+			return argv;
+	}
+	free(s);
+	free(argv);
+	return NULL;
+}
+#elif !defined(_WIN32) && !defined(_WIN64)
+# define split_command(c) NULL
+#endif
+
+#if !defined(_WIN32) && !defined(_WIN64)
+/*
+ * Like system(3) interrupt and quit signals are ignored while child
+ * processes are running.  Call this before starting a child.
+ */
+static void
+ignore_signals(void)
+{
+	struct sigaction sa;
+
+	if (nchild == 0) {
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sa.sa_handler = SIG_IGN;
+		sigaction(SIGINT, &sa, &old_int);
+		sigaction(SIGQUIT, &sa, &old_quit);
+	}
+}
+
+/*
+ * Restore interrupt and quit signals if no children are running.
+ */
+static void
+restore_signals(void)
+{
+	if (nchild == 0) {
+		sigaction(SIGINT, &old_int, NULL);
+		sigaction(SIGQUIT, &old_quit, NULL);
+	}
+}
+
+/*
+ * Start a process to execute a command.  If 'argv' isn't NULL it's
+ * executed directly, otherwise a shell is used.  If 'out' isn't NULL
+ * it gives pipes for standard output and error.
+ */
+static pid_t
+spawn(const char *cmd, char **argv, int flag, const int *out)
+{
+	pid_t pid;
+
+	ignore_signals();
+	pid = fork();
+	if (pid == 0) {
+		sigaction(SIGINT, &old_int, NULL);
+		sigaction(SIGQUIT, &old_quit, NULL);
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+		// Only recursive invocations of make share the jobserver pipe
+		if ((flag & JC_MAKE) && js_rfd >= 0) {
+			fcntl(js_rfd, F_SETFD, 0);
+			fcntl(js_wfd, F_SETFD, 0);
+		}
+#else
+		(void)flag;
+#endif
+		if (out) {
+			dup2(out[0], 1);
+			dup2(out[1], 2);
+		}
+		if (argv) {
+			// Report failure as the shell would
+			execvp(argv[0], argv);
+			dprintf(2, "%s: %s: %s\n", myname, argv[0], strerror(errno));
+			_exit(errno == ENOENT ? 127 : 126);
+		}
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+
+	if (pid > 0)
+		nchild++;
+	else
+		restore_signals();
+	return pid;
+}
+
+#if ENABLE_FEATURE_MAKE_COSHELL
+/*
+ * Skip a quoted string or a parenthesised list starting at 's',
+ * returning a pointer to the character which closes it or to the end
+ * of the string.
+ */
+static const char *
+skip_quoted(const char *s)
+{
+	char close = *s == '(' ? ')' : *s;
+
+	while (*++s && *s != close) {
+		if (close == '\'')
+			continue;
+		if (*s == '\\' && s[1])
+			s++;
+		else if ((close == ')' && strchr("'\"`(", *s)) ||
+				(close == '"' && *s == '$' && s[1] == '('))
+			s = skip_quoted(s + (*s == '$'));
+		if (!*s)
+			break;
+	}
+	return s;
+}
+
+/*
+ * Return TRUE if a command can't change the state of the shell which
+ * runs it, so it needn't be run in a subshell.  Commands which use a
+ * builtin such as 'cd' or 'export', assign variables, define functions
+ * or start background jobs aren't safe.  The check is conservative:
+ * a command whose name isn't known until it's expanded is unsafe.
+ */
+static int
+coshell_safe(const char *cmd)
+{
+	static const char *unsafe[] = {
+		".", "alias", "bg", "break", "builtin", "case", "cd", "command",
+		"continue", "declare", "eval", "exec", "exit", "export", "fg",
+		"for", "function", "getopts", "hash", "local", "popd", "pushd",
+		"read", "readonly", "return", "select", "set", "shift", "source",
+		"trap", "typeset", "ulimit", "umask", "unalias", "unset", "wait"
+	};
+	static const char *reserved[] = {
+		"!", "do", "done", "elif", "else", "fi", "if", "then", "until",
+		"while", "{", "}"
+	};
+	const char *s = cmd, *start, *t;
+	char word[16];
+	size_t i, len;
+	int cmdpos = TRUE, redirect = FALSE;
+
+	while (*s) {
+		if (*s == ' ' || *s == '\t') {
+			s++;
+		} else if (strchr("\n;|{})", *s)) {
+			s++;
+			cmdpos = TRUE;
+		} else if (*s == '&') {
+			// '&&' is fine, a background job isn't
+			if (s[1] != '&')
+				return FALSE;
+			s += 2;
+			cmdpos = TRUE;
+		} else if (*s == '<' || *s == '>') {
+			// The word after a redirection isn't a command
+			s += strspn(s, "<>&|-");
+			redirect = TRUE;
+		} else if (*s == '(') {
+			// A subshell is fine, a function definition isn't
+			if (!cmdpos)
+				return FALSE;
+			s = skip_quoted(s);
+			if (*s)
+				s++;
+		} else if (*s == '#' && (s == cmd || strchr(" \t\n;&|", s[-1]))) {
+			s += strcspn(s, "\n");
+		} else {
+			// Find the end of a word, noting its unquoted text
+			start = s;
+			len = 0;
+			while (*s && !strchr(" \t\n;&|<>()", *s)) {
+				if (*s == '$' && s[1] == '(' && s[2] == '(') {
+					// Arithmetic expansion may assign variables
+					return FALSE;
+				} else if (*s == '$' && s[1] == '{') {
+					// As may ${var=value}
+					for (t = s + 2; *t && *t != '}'; t++) {
+						if (*t == '=')
+							return FALSE;
+					}
+					s = t;
+				} else if (*s == '$' && s[1] == '(') {
+					// Command substitution is run in a subshell
+					s = skip_quoted(s + 1);
+				} else if (strchr("'\"`", *s)) {
+					for (t = skip_quoted(s); ++s < t;) {
+						if (len < sizeof(word) - 1)
+							word[len++] = *s;
+					}
+				} else {
+					if (*s == '\\' && s[1])
+						s++;
+					if (len < sizeof(word) - 1)
+						word[len++] = *s;
+				}
+				if (*s)
+					s++;
+			}
+			word[len] = '\0';
+
+			if (redirect || !cmdpos) {
+				redirect = FALSE;
+				continue;
+			}
+			// A file descriptor number before a redirection
+			if ((*s == '<' || *s == '>') && len &&
+					strspn(start, "0123456789") == len)
+				continue;
+
+			// The name of the command must be known and the word
+			// mustn't be an assignment
+			t = strpbrk(start, "$`");
+			if (t && t < s)
+				return FALSE;
+			for (t = start; *t == '_' || isalnum((unsigned char)*t); t++)
+				;
+			if (t != start && *t == '=')
+				return FALSE;
+			for (i = 0; i < sizeof(unsafe) / sizeof(unsafe[0]); i++) {
+				if (strcmp(word, unsafe[i]) == 0)
+					return FALSE;
+			}
+			for (i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+				if (strcmp(word, reserved[i]) == 0)
+					break;
+			}
+			cmdpos = i < sizeof(reserved) / sizeof(reserved[0]);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Start a shell which reads commands from a pipe.  Make's standard
+ * input is passed to it as file descriptor 3 and it reports the exit
+ * status of each command on file descriptor 4.
+ */
+static struct coproc *
+new_coproc(void)
+{
+	struct coproc *cp;
+	int cmd[2], stat[2];
+	pid_t pid;
+
+	if (pipe(cmd) == -1)
+		return NULL;
+	if (pipe(stat) == -1) {
+		close(cmd[0]);
+		close(cmd[1]);
+		return NULL;
+	}
+	fcntl(cmd[1], F_SETFD, FD_CLOEXEC);
+	fcntl(stat[0], F_SETFD, FD_CLOEXEC);
+	fcntl(stat[0], F_SETFL, O_NONBLOCK);
+
+	pid = fork();
+	if (pid == 0) {
+		int rfd = fcntl(cmd[0], F_DUPFD, 10);
+		int wfd = fcntl(stat[1], F_DUPFD, 10);
+
+		sigaction(SIGINT, &old_int, NULL);
+		sigaction(SIGQUIT, &old_quit, NULL);
+		close(cmd[0]);
+		close(stat[1]);
+		if (dup2(0, 3) == -1) {
+			// Make's standard input is closed
+			int fd = open("/dev/null", O_RDONLY);
+			if (fd != 3) {
+				dup2(fd, 3);
+				close(fd);
+			}
+		}
+		dup2(rfd, 0);
+		dup2(wfd, 4);
+		close(rfd);
+		close(wfd);
+		execl("/bin/sh", "sh", (char *)NULL);
+		_exit(127);
+	}
+	close(cmd[0]);
+	close(stat[1]);
+	if (pid == -1) {
+		close(cmd[1]);
+		close(stat[0]);
+		return NULL;
+	}
+
+	cp = xmalloc(sizeof(struct coproc));
+	cp->cp_next = NULL;
+	cp->cp_pid = pid;
+	cp->cp_cmdfd = cmd[1];
+	cp->cp_statfd = stat[0];
+	cp->cp_len = 0;
+	return cp;
+}
+
+/*
+ * Discard a shell.  Closing its command pipe makes it exit.
+ */
+static void
+free_coproc(struct coproc *cp)
+{
+	close(cp->cp_cmdfd);
+	close(cp->cp_statfd);
+	free(cp);
+}
+
+/*
+ * If an idle shell has exited discard it and return TRUE.
+ */
+static int
+reap_coshell(pid_t pid)
+{
+	struct coproc **cpp, *cp;
+
+	for (cpp = &idleshells; (cp = *cpp); cpp = &cp->cp_next) {
+		if (cp->cp_pid == pid) {
+			*cpp = cp->cp_next;
+			free_coproc(cp);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Send a command to an idle shell, starting one if necessary.  Unless
+ * it's safe not to, it's run in a subshell so changes to the shell's
+ * state, such as the current directory or variables, don't affect
+ * later commands.  Return the process id of the shell, or -1 on
+ * failure.
+ */
+static pid_t
+send_coshell(struct job *jp, const char *cmd)
+{
+	struct sigaction sa, old_pipe;
+	struct coproc *cp;
+	static const char report[] = " <&3 3<&- 4>&-; set -- $?; "
+		"printf '%d ' $1 >&4; [ $1 -le 128 ] || kill -l $1 >&4 2>&-; "
+		"echo >&4; set --\n";
+	char *buf, *s;
+	const char *t;
+	size_t len;
+	ssize_t n;
+	int status, safe = coshell_safe(cmd);
+
+	ignore_signals();
+	while ((cp = idleshells) != NULL) {
+		idleshells = cp->cp_next;
+		if (waitpid(cp->cp_pid, &status, WNOHANG) == 0)
+			break;
+		free_coproc(cp);
+	}
+	if (cp == NULL && (cp = new_coproc()) == NULL) {
+		restore_signals();
+		return -1;
+	}
+
+	// (eval 'cmd') <&3 3<&- 4>&-; ... or { eval 'cmd'; } <&3 ...
+	// The exit status is written to descriptor 4, followed by the name
+	// of the signal if it may have been killed by one.
+	len = strlen(cmd);
+	for (t = cmd; (t = strchr(t, '\'')); t++)
+		len += 3;
+	s = buf = xmalloc(len + sizeof(report) + 16);
+	s = stpcpy(s, safe ? "{ eval '" : "(eval '");
+	for (t = cmd; *t; t++) {
+		if (*t == '\'')
+			s = stpcpy(s, "'\\''");
+		else
+			*s++ = *t;
+	}
+	s = stpcpy(stpcpy(s, safe ? "'; }" : "')"), report);
+
+	// A shell which has died mustn't kill make
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, &old_pipe);
+	for (t = buf; t < s; t += n) {
+		n = write(cp->cp_cmdfd, t, s - t);
+		if (n < 0 && errno != EINTR)
+			break;
+		if (n < 0)
+			n = 0;
+	}
+	sigaction(SIGPIPE, &old_pipe, NULL);
+	free(buf);
+
+	if (t != s) {
+		kill(cp->cp_pid, SIGKILL);
+		waitpid(cp->cp_pid, &status, 0);
+		free_coproc(cp);
+		restore_signals();
+		return -1;
+	}
+	nchild++;
+	jp->j_coproc = cp;
+	return cp->cp_pid;
+}
+#endif
+
+/*
+ * Start a command whose output isn't being collected.
+ */
+static pid_t
+start_command(struct job *jp, const char *cmd, char **argv, int flag)
+{
+#if ENABLE_FEATURE_MAKE_COSHELL
+	// Recursive invocations of make need the jobserver pipe
+	if (coshell && !argv && !(flag & JC_MAKE) && !doinclude) {
+		if (maxjobs > 1)
+			catch_sigchld();
+		return send_coshell(jp, cmd);
+	}
+#else
+	(void)jp;
+#endif
+	return spawn(cmd, argv, flag, NULL);
+}
+
+#if ENABLE_FEATURE_MAKE_RUSAGE
+// Not in POSIX, but widely available
+pid_t wait4(pid_t pid, int *status, int options, struct rusage *ru);
+
+/*
+ * Return the file to which resource usage is reported, opening it if
+ * necessary.  NULL is returned if PDPMAKE_RUSAGE isn't set.
+ */
+static FILE *
+rusage_file(void)
+{
+	static bool done;
+	const char *name;
+
+	if (!done) {
+		done = TRUE;
+		name = getenv("PDPMAKE_RUSAGE");
+		if (name && *name) {
+			rusagefile = fopen(name, "a");
+			if (rusagefile)
+				fcntl(fileno(rusagefile), F_SETFD, FD_CLOEXEC);
+			else
+				warning("can't open %s: %s", name, strerror(errno));
+		}
+	}
+	return rusagefile;
+}
+
+static double
+tv_sec(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Report the resources used by the current command of a job: target,
+ * makefile, line, exit status, elapsed, user and system time in
+ * seconds, maximum resident set size in kilobytes and blocks read and
+ * written.  Each record is written in a single write so reports from
+ * recursive invocations of make can share the file.
+ */
+static void
+report_rusage(struct job *jp, int status, const struct rusage *ru)
+{
+	struct jobcmd *jc = jp->j_cmd;
+	struct timespec now;
+
+	if (!rusagefile)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(rusagefile, "%s\t%s\t%d\t%d\t%.3f\t%.3f\t%.3f\t%ld\t%ld\t%ld\n",
+			jp->j_name->n_name, jc->jc_makefile ? jc->jc_makefile : "",
+			jc->jc_dispno,
+			WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+			(now.tv_sec - jp->j_cmdstart.tv_sec) +
+				(now.tv_nsec - jp->j_cmdstart.tv_nsec) / 1e9,
+			tv_sec(&ru->ru_utime), tv_sec(&ru->ru_stime),
+			(long)ru->ru_maxrss, (long)ru->ru_inblock, (long)ru->ru_oublock);
+	fflush(rusagefile);
+}
+#endif
+
+/*
+ * Wait for a child process.  If pid is -1 any child will do.  The
+ * resources it used are returned in 'ru'.
+ */
+static pid_t
+wait_child(pid_t pid, int *status, struct rusage *ru)
+{
+	do {
+#if ENABLE_FEATURE_MAKE_RUSAGE
+		pid = wait4(pid, status, 0, ru);
+#else
+		pid = waitpid(pid, status, 0);
+#endif
+	} while (pid == -1 && errno == EINTR);
+
+	if (pid == -1)
+		error("wait failed: %s", strerror(errno));
+
+#if ENABLE_FEATURE_MAKE_COSHELL
+	// An idle shell isn't counted as a running child
+	if (reap_coshell(pid))
+		return pid;
+#endif
+	nchild--;
+	restore_signals();
+	return pid;
+}
+#endif
+
+#if ENABLE_FEATURE_MAKE_COSHELL
+/*
+ * Get the exit status of the command a job's shell is running.  If
+ * 'block' is FALSE return FALSE if it hasn't finished.  The status is
+ * converted to the form returned by waitpid().  If the shell died its
+ * own status is returned.
+ */
+static int
+coshell_status(struct job *jp, int *status, int block)
+{
+	struct coproc *cp = jp->j_coproc;
+	struct pollfd pfd;
+	ssize_t len;
+	size_t i;
+	char *name;
+	int code;
+
+	for (;;) {
+		len = read(cp->cp_statfd, cp->cp_buf + cp->cp_len,
+					sizeof(cp->cp_buf) - 1 - cp->cp_len);
+		if (len > 0) {
+			cp->cp_len += len;
+			if (cp->cp_buf[cp->cp_len - 1] == '\n' ||
+					cp->cp_len == sizeof(cp->cp_buf) - 1)
+				break;
+		} else if (len == 0) {
+			// The shell has exited
+			wait_child(cp->cp_pid, status, NULL);
+			jp->j_coproc = NULL;
+			free_coproc(cp);
+			return TRUE;
+		} else if (errno == EAGAIN) {
+			// The rest of a partly written status follows shortly
+			if (!block && cp->cp_len == 0)
+				return FALSE;
+			pfd.fd = cp->cp_statfd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, -1);
+		} else if (errno != EINTR) {
+			error("can't read shell status: %s", strerror(errno));
+		}
+	}
+
+	// The shell gives the name of the signal if the exit status is
+	// 128 + n for a signal n.  A shell can't tell that from a command
+	// which exits with that status, but only the names of signals
+	// which kill a process are recognised.
+	cp->cp_buf[cp->cp_len] = '\0';
+	code = (int)strtol(cp->cp_buf, &name, 10);
+	*status = (code & 0xff) << 8;
+	name += strspn(name, " ");
+	name[strcspn(name, "\n")] = '\0';
+	for (i = 0; i < sizeof(signames) / sizeof(signames[0]); i++) {
+		if (strcmp(name, signames[i].name) == 0) {
+			*status = signames[i].num;
+			break;
+		}
+	}
+
+	cp->cp_len = 0;
+	cp->cp_next = idleshells;
+	idleshells = cp;
+	jp->j_coproc = NULL;
+	nchild--;
+	restore_signals();
+	return TRUE;
+}
+#endif
+
+/*
+ * Free a command line of a job.
+ */
+static void
+free_jobcmd(struct jobcmd *jc)
+{
+	free(jc->jc_cmd);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	free(jc->jc_echo);
+#endif
+	free(jc);
+}
+
+/*
+ * Handle the exit status of the current command of a job.
+ */
+static void
+endcmd(struct job *jp, int status)
+{
+	struct jobcmd *jc = jp->j_cmd;
+	struct name *np = jp->j_name;
+
+	// Location of command in makefile (for use in error messages)
+	makefile = jc->jc_makefile;
+	dispno = jc->jc_dispno;
+
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+	// Write collected output before any diagnostic
+	if (outsync == OUTSYNC_LINE || (status != 0 && !(jc->jc_flag & JC_IGNORE)))
+		flush_output(jp);
+#endif
+
+	// If this command was being run to create an include file
+	// or bring it up-to-date errors should be ignored and a
+	// failure status returned.
+	if (status == -1 && !doinclude) {
+		error("couldn't execute '%s'", jc->jc_cmd);
+	} else if (status != 0 && !(jc->jc_flag & JC_IGNORE)) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if (!posix && WIFSIGNALED(status))
+			remove_name(np);
+#endif
+		if (doinclude) {
+			warning("failed to build '%s'", np->n_name);
+		} else {
+			const char *err_type = NULL;
+			int err_value = 1;
+
+			if (WIFEXITED(status)) {
+				err_type = "exit";
+				err_value = WEXITSTATUS(status);
+			} else if (WIFSIGNALED(status)) {
+				err_type = "signal";
+				err_value = WTERMSIG(status);
+			}
+
+			if (!quest || err_value == 127) {
+				if (err_type)
+					diagnostic("failed to build '%s' %s %d",
+							np->n_name, err_type, err_value);
+				else
+					diagnostic("failed to build '%s'", np->n_name);
+			}
+
+			// Skip any remaining commands
+			jp->j_estat |= MAKE_FAILURE;
+			while (jp->j_cmd->jc_next) {
+				jc = jp->j_cmd->jc_next;
+				jp->j_cmd->jc_next = jc->jc_next;
+				free_jobcmd(jc);
+			}
+			if (!errcont)
+				stopping = TRUE;
+			goto end;
+		}
+	}
+	jp->j_estat = MAKE_DIDSOMETHING;
+ end:
+	makefile = NULL;
+}
+
+/*
+ * Run the commands of a job until one needs a process to execute it
+ * or there are none left.  Return TRUE if a process was started.
+ */
+static int
+nextcmd(struct job *jp)
+{
+	struct jobcmd *jc;
+
+	for (; (jc = jp->j_cmd); jp->j_cmd = jc->jc_next, free_jobcmd(jc)) {
+		if (jp->j_pid) {
+			// The command's process has finished
+			jp->j_pid = 0;
+			continue;
+		}
+
+		if (!(jc->jc_flag & JC_SILENT) && *jc->jc_cmd != '\0') {
+			const char *echo = jc->jc_cmd;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (jc->jc_echo)
+				echo = jc->jc_echo;
+#endif
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+			if (collect_output(jc)) {
+				add_output(&jp->j_out[0], echo, strlen(echo));
+				add_output(&jp->j_out[0], "\n", 1);
+			} else
+#endif
+			{
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+				flush_output(jp);
+#endif
+				puts(echo);
+				fflush(stdout);
+			}
+		}
+
+		if (quest && !(jc->jc_flag & JC_PLUS)) {
+			// MAKE_FAILURE means rebuild is needed
+			jp->j_estat |= MAKE_FAILURE | MAKE_DIDSOMETHING;
+			continue;
+		}
+
+		if ((jc->jc_flag & JC_EXECUTE) && *jc->jc_cmd != '\0') {
+			// Get the shell, or for simple commands the system, to execute it
+			int status;
+			char *cmd = !(jc->jc_flag & JC_IGNORE)
+							IF_FEATURE_MAKE_EXTENSIONS(&& posix) ?
+							xconcat3("set -e;", jc->jc_cmd, "") : jc->jc_cmd;
+#if !defined(_WIN32) && !defined(_WIN64)
+			char **argv = split_command(cmd);
+#endif
+#if ENABLE_FEATURE_MAKE_PREFETCH
+			// Times fetched in advance may now be out of date
+			cmdcount++;
+#endif
+#if ENABLE_FEATURE_MAKE_RUSAGE
+			if (rusage_file())
+				clock_gettime(CLOCK_MONOTONIC, &jp->j_cmdstart);
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+			// There's no process id: just note the command is running.
+			jp->j_pid = -1;
+			status = win32_system_via_sh(cmd);
+			jp->j_pid = 0;
+#elif ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+			if (collect_output(jc)) {
+				int out[2], fds[2], i;
+
+				catch_sigchld();
+				for (i = 0; i < 2; i++) {
+					if (pipe(fds) == -1)
+						error("can't create pipe: %s", strerror(errno));
+					fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+					fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+					fcntl(fds[0], F_SETFL, O_NONBLOCK);
+					jp->j_out[i].o_fd = fds[0];
+					out[i] = fds[1];
+				}
+				jp->j_pid = spawn(cmd, argv, jc->jc_flag, out);
+				close(out[0]);
+				close(out[1]);
+				if (jp->j_pid <= 0)
+					end_output(jp);
+			} else {
+				flush_output(jp);
+				jp->j_pid = start_command(jp, cmd, argv, jc->jc_flag);
+			}
+			status = -1;
+#else
+			jp->j_pid = start_command(jp, cmd, argv, jc->jc_flag);
+			status = -1;
+#endif
+			if (cmd != jc->jc_cmd)
+				free(cmd);
+#if !defined(_WIN32) && !defined(_WIN64)
+			if (argv) {
+				free(argv[0]);
+				free(argv);
+			}
+#endif
+			if (jp->j_pid > 0)
+				return TRUE;
+			jp->j_pid = 0;
+			endcmd(jp, status);
+		} else if ((jc->jc_flag & JC_EXECUTE) || dryrun) {
+			jp->j_estat = MAKE_DIDSOMETHING;
+		}
+	}
+	return FALSE;
+}
+
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+/*
+ * Note when a job with commands is started.
+ */
+static void
+start_timer(struct job *jp)
+{
+	if (timefile && jp->j_cmd)
+		clock_gettime(CLOCK_MONOTONIC, &jp->j_start);
+}
+
+/*
+ * Record the time taken by a job.  It's averaged with the time from
+ * the log to smooth out variations between runs.
+ */
+static void
+stop_timer(struct job *jp)
+{
+	struct name *np = jp->j_name;
+	struct timespec now;
+	uint32_t msec;
+
+	if (jp->j_start.tv_sec || jp->j_start.tv_nsec) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		msec = (uint32_t)((now.tv_sec - jp->j_start.tv_sec) * 1000 +
+						(now.tv_nsec - jp->j_start.tv_nsec) / 1000000);
+		np->n_msec = np->n_msec ? (np->n_msec + msec + 1) / 2 : msec + 1;
+		timesdirty = TRUE;
+	}
+}
+
+/*
+ * Read the times taken to make targets in earlier runs.  The log is
+ * kept in the same directory as the named makefile.  It's also saved
+ * on exit, so the times from a failed build aren't lost.
+ */
+void
+load_times(const char *name)
+{
+	FILE *fp;
+	char *dir, *line = NULL, *s;
+	size_t size = 0;
+	ssize_t len;
+	unsigned long msec;
+
+	dir = xstrdup(name);
+	timefile = xconcat3(dirname(dir), "/", ".pdpmake.times");
+	free(dir);
+	atexit(save_times);
+
+	if ((fp = fopen(timefile, "r")) == NULL)
+		return;
+
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		msec = strtoul(line, &s, 10);
+		if (s != line && *s++ == ' ' && msec <= UINT32_MAX &&
+				is_valid_target(s))
+			newname(s)->n_msec = (uint32_t)msec;
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Write the log of times taken to make targets, if it's changed.
+ */
+void
+save_times(void)
+{
+	FILE *fp;
+	char *tmp;
+	struct name *np;
+	int i;
+
+	if (!timesdirty)
+		return;
+	timesdirty = FALSE;
+
+	tmp = xconcat3(timefile, ".tmp", "");
+	if ((fp = fopen(tmp, "w")) != NULL) {
+		for (i = 0; i < namesize; i++) {
+			for (np = namehead[i]; np; np = np->n_next) {
+				if (np->n_msec)
+					fprintf(fp, "%lu %s\n", (unsigned long)np->n_msec,
+								np->n_name);
+			}
+		}
+		if (fclose(fp) != 0 || rename(tmp, timefile) != 0)
+			unlink(tmp);
+	}
+	free(tmp);
+}
+
+/*
+ * Estimate how long the build will take to finish once each target
+ * below a goal has been made:  the time to make the target plus the
+ * longest chain of targets which depend on it.  The estimate is used
+ * to order the queue of jobs waiting to start.
+ */
+void
+plan_jobs(struct name *goal)
+{
+	struct frame {
+		struct name *f_name;
+		struct rule *f_rule;
+		struct depend *f_dep;
+	} *stack = NULL, *fp;
+	struct name **order = NULL, *np;
+	struct rule *rp;
+	struct depend *dp;
+	size_t depth = 0, nstack = 0, norder = 0, size = 0, i;
+
+	if (!timefile || (goal->n_flag & N_DONE))
+		return;
+
+	// List targets so each comes after all its prerequisites
+	np = goal;
+	np->n_flag |= N_PLAN;
+	for (;;) {
+		if (np) {
+			if (depth == nstack) {
+				nstack = nstack * 2 + 16;
+				stack = xrealloc(stack, nstack * sizeof(*stack));
+			}
+			fp = &stack[depth++];
+			fp->f_name = np;
+			fp->f_rule = np->n_rule;
+			fp->f_dep = np->n_rule ? np->n_rule->r_dep : NULL;
+		}
+		if (depth == 0)
+			break;
+
+		fp = &stack[depth - 1];
+		np = NULL;
+		if (fp->f_dep) {
+			np = fp->f_dep->d_name;
+			fp->f_dep = fp->f_dep->d_next;
+			if ((np->n_flag & (N_PLAN | N_DONE | N_WAIT)))
+				np = NULL;
+			else
+				np->n_flag |= N_PLAN;
+		} else if (fp->f_rule && (fp->f_rule = fp->f_rule->r_next)) {
+			fp->f_dep = fp->f_rule->r_dep;
+		} else {
+			if (norder == size) {
+				size = size * 2 + 16;
+				order = xrealloc(order, size * sizeof(*order));
+			}
+			order[norder++] = fp->f_name;
+			depth--;
+		}
+	}
+
+	// Work down from the goal to its prerequisites
+	for (i = 0; i < norder; i++)
+		order[i]->n_cost = 0;
+	goal->n_cost = goal->n_msec;
+	for (i = norder; i-- > 0;) {
+		np = order[i];
+		np->n_flag &= ~N_PLAN;
+		for (rp = np->n_rule; rp; rp = rp->r_next) {
+			for (dp = rp->r_dep; dp; dp = dp->d_next) {
+				struct name *dep = dp->d_name;
+
+				if (!(dep->n_flag & (N_DONE | N_WAIT)))
+					dep->n_cost = MAX(dep->n_cost, np->n_cost + dep->n_msec);
+			}
+		}
+	}
+	free(order);
+	free(stack);
+}
+#endif
+
+/*
+ * Tidy up after all commands of a job have been run.  Return the
+ * status of the job.
+ */
+static int
+endjob(struct job *jp)
+{
+	struct name *np = jp->j_name;
+	int estat = jp->j_estat;
+
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+	flush_output(jp);
+	free(jp->j_out[0].o_buf);
+	free(jp->j_out[1].o_buf);
+#endif
+	if (dotouch && !(np->n_flag & N_PHONY) && !(estat & MAKE_DIDSOMETHING)) {
+		touch(np);
+		estat = MAKE_DIDSOMETHING;
+	}
+
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	stop_timer(jp);
+#endif
+	np->n_flag &= ~N_RUNNING;
+	if (estat & MAKE_FAILURE)
+		np->n_flag |= N_FAILED;
+	free(jp);
+	return estat;
+}
+
+/*
+ * Tidy up after a job run in the background has finished.  As there's
+ * no caller to do so update the target's modification time here,
+ * except for double-colon rules:  make() does that once all the rules
+ * have been processed.  Targets waiting for this one may now proceed.
+ */
+static void
+endjob_background(struct job *jp)
+{
+	struct name *np = jp->j_name;
+
+	if ((endjob(jp) & MAKE_DIDSOMETHING) && !(np->n_flag & N_DOUBLE))
+		update_time(np);
+	job_finished(np);
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS && !defined(_WIN32) && !defined(_WIN64)
+int getloadavg(double loadavg[], int nelem);
+
+/*
+ * The one minute load average takes a while to respond to new jobs.
+ * Those started recently are counted with a weight which decays at
+ * the same rate as the load average catches up with them.
+ */
+static void
+decay_jobs(void)
+{
+	struct timespec now;
+	double x;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	x = ((now.tv_sec - loadtime.tv_sec) +
+			(now.tv_nsec - loadtime.tv_nsec) / 1e9) / 60.0;
+	loadtime = now;
+
+	// Approximate exp(-x) without needing the maths library
+	recentjobs /= 1.0 + x + x * x / 2.0;
+	if (recentjobs > nrunning)
+		recentjobs = nrunning;
+}
+
+/*
+ * Return TRUE if the load average is low enough to start another job.
+ * If no jobs are running one is always allowed to start.
+ */
+static int
+load_ok(void)
+{
+	double avg;
+
+	if (loadlimit <= 0.0 || nrunning == 0)
+		return TRUE;
+	decay_jobs();
+	return getloadavg(&avg, 1) != 1 || avg + recentjobs < loadlimit;
+}
+#endif
+
+/*
+ * Add a job to the queue of those waiting to start.  Jobs for targets
+ * with the longest chains of dependent targets still to be made come
+ * first, otherwise jobs are started in the order they were queued.
+ */
+static void
+queue_job(struct job *jp)
+{
+	struct job **jpp;
+#if !defined(_WIN32) && !defined(_WIN64)
+	static bool stop_on_exit;
+
+	if (!stop_on_exit) {
+		stop_on_exit = TRUE;
+		atexit(stop_jobs);
+	}
+#endif
+
+	jp->j_next = NULL;
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	if (queuelast && queuelast->j_name->n_cost < jp->j_name->n_cost) {
+		for (jpp = &queuehead; (*jpp)->j_name->n_cost >= jp->j_name->n_cost;
+				jpp = &(*jpp)->j_next)
+			;
+		jp->j_next = *jpp;
+		*jpp = jp;
+		return;
+	}
+#endif
+	jpp = queuelast ? &queuelast->j_next : &queuehead;
+	*jpp = queuelast = jp;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Set up the pools defined by .POOL.name special targets.  Their
+ * prerequisites are the targets and inference rules in the pool.  The
+ * depth of the pool is given by the macro of the same name, default 1.
+ * Each member records its pool so it needn't be looked up for every
+ * job.  Targets made by an inference rule pick up its pool in dyndep().
+ */
+void
+init_pools(void)
+{
+	struct name *np;
+	struct macro *mp;
+	struct pool *pp;
+	struct rule *rp;
+	struct depend *dp;
+	char *val;
+	long depth;
+	int i;
+
+	for (i = 0; i < namesize; i++) {
+		for (np = namehead[i]; np; np = np->n_next) {
+			if (!(np->n_flag & N_SPECIAL) ||
+					strncmp(np->n_name, ".POOL.", 6) != 0)
+				continue;
+			depth = 1;
+			if ((mp = getmp(np->n_name)) != NULL) {
+				val = expand_macros(mp->m_val, FALSE);
+				depth = strtol(val, NULL, 10);
+				free(val);
+			}
+			pp = xmalloc(sizeof(struct pool));
+			pp->p_name = np;
+			pp->p_depth = depth > INT_MAX ? INT_MAX : depth > 1 ? (int)depth : 1;
+			pp->p_running = 0;
+			for (rp = np->n_rule; rp; rp = rp->r_next) {
+				for (dp = rp->r_dep; dp; dp = dp->d_next) {
+					if (!dp->d_name->n_pool)
+						dp->d_name->n_pool = pp;
+				}
+			}
+		}
+	}
+}
+#endif
+
+/*
+ * Return the link to the first queued job which can be started without
+ * exceeding the depth of its pool, or NULL.  The job before it in the
+ * queue is returned in 'prev'.
+ */
+static struct job **
+next_job(struct job **prev)
+{
+	struct job **jpp;
+
+	*prev = NULL;
+	for (jpp = &queuehead; *jpp; *prev = *jpp, jpp = &(*jpp)->j_next) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		struct pool *pp = (*jpp)->j_pool;
+
+		if (pp && pp->p_running >= pp->p_depth)
+			continue;
+#endif
+		return jpp;
+	}
+	return NULL;
+}
+
+/*
+ * Start queued jobs until the limit on parallel jobs is reached.
+ */
+static void
+start_jobs(void)
+{
+	struct job *jp, **jpp, *prev;
+
+	while (nrunning < maxjobs && !stopping && (jpp = next_job(&prev))) {
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+		// Each job after the first needs a token from the jobserver
+		if (js_rfd >= 0 && nrunning > ntokens)
+			break;
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS && !defined(_WIN32) && !defined(_WIN64)
+		if (!load_ok())
+			break;
+#endif
+		jp = *jpp;
+		*jpp = jp->j_next;
+		if (jp == queuelast)
+			queuelast = prev;
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+		start_timer(jp);
+#endif
+
+		if (nextcmd(jp)) {
+			jp->j_next = running;
+			running = jp;
+			nrunning++;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (jp->j_pool)
+				jp->j_pool->p_running++;
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS && !defined(_WIN32) && !defined(_WIN64)
+			if (loadlimit > 0.0) {
+				decay_jobs();
+				recentjobs += 1.0;
+			}
+#endif
+		} else {
+			endjob_background(jp);
+		}
+	}
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+	if (js_rfd >= 0)
+		put_tokens(MAX(nrunning - 1, 0));
+#endif
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+/*
+ * Wait for a command run by a background job to finish, then either
+ * start the job's next command or complete the job.
+ */
+static void
+reap(void)
+{
+	struct job *jp, **jpp;
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+	struct job *prev;
+#endif
+	struct rusage ru;
+	int status;
+	pid_t pid;
+
+	start_jobs();
+	while (nrunning) {
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+		// Wait for a token to start another job or for a child to exit
+		if (js_rfd >= 0 && nrunning < maxjobs && !stopping &&
+				nrunning > ntokens && next_job(&prev) && load_ok() &&
+				get_token()) {
+			start_jobs();
+			return;
+		}
+#endif
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+		// Collect output from commands until one of them exits
+		if (sigfd[0] >= 0)
+			wait_output(-1);
+#endif
+#if ENABLE_FEATURE_MAKE_COSHELL
+		// Check for a command run by a shell before waiting for a child
+		for (jpp = &running; (jp = *jpp); jpp = &jp->j_next) {
+			if (jp->j_coproc && coshell_status(jp, &status, FALSE))
+				break;
+		}
+		if (jp) {
+			memset(&ru, 0, sizeof(ru));
+		} else
+#endif
+		{
+			pid = wait_child(-1, &status, &ru);
+			for (jpp = &running; (jp = *jpp); jpp = &jp->j_next) {
+				if (jp->j_pid == pid)
+					break;
+			}
+			if (jp == NULL)
+				continue;
+#if ENABLE_FEATURE_MAKE_COSHELL
+			if (jp->j_coproc) {
+				// The shell running the command has died
+				free_coproc(jp->j_coproc);
+				jp->j_coproc = NULL;
+			}
+#endif
+		}
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+		end_output(jp);
+#endif
+#if ENABLE_FEATURE_MAKE_RUSAGE
+		report_rusage(jp, status, &ru);
+#endif
+
+		endcmd(jp, status);
+		if (stopping || !nextcmd(jp)) {
+			*jpp = jp->j_next;
+			nrunning--;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (jp->j_pool)
+				jp->j_pool->p_running--;
+#endif
+			endjob_background(jp);
+			start_jobs();
+		}
+		if (!stopping)
+			return;
+	}
+	if (stopping)
+		exit(2);
+}
+#endif
+
+/*
+ * Wait for a background job to make progress.  Used by make() when no
+ * target can proceed until a command has finished.
+ */
+void
+wait_jobs(void)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	reap();
+#endif
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Append a line to a string, which may be NULL.
+ */
+static char *
+append_line(char *str, const char *line)
+{
+	char *s;
+
+	if (!str)
+		return xstrdup(line);
+	s = xconcat3(str, "\n", line);
+	free(str);
+	return s;
+}
+
+/*
+ * For .ONESHELL join the command lines of a job so they're run by a
+ * single shell.  Only lines without an '@' prefix are echoed.  The
+ * '-' prefix applies to the whole command if any line has it.  The
+ * command is only executed under -n, -q or -t if every line would be,
+ * otherwise a '+' prefix or $(MAKE) on one line would run them all.
+ */
+static void
+join_cmds(struct job *jp)
+{
+	struct jobcmd *jc, *next;
+	char *cmd = NULL, *echo = NULL;
+	uint8_t flag = JC_SILENT | JC_EXECUTE | JC_PLUS;
+	uint8_t any = 0;
+
+	for (jc = jp->j_cmd; jc; jc = next) {
+		next = jc->jc_next;
+		if (*jc->jc_cmd != '\0') {
+			cmd = append_line(cmd, jc->jc_cmd);
+			if (!(jc->jc_flag & JC_SILENT)) {
+				echo = append_line(echo, jc->jc_cmd);
+				flag &= ~JC_SILENT;
+			}
+			flag &= jc->jc_flag | ~(JC_EXECUTE | JC_PLUS);
+			flag |= jc->jc_flag & (JC_IGNORE | JC_MAKE);
+			any |= jc->jc_flag;
+		}
+		if (jc != jp->j_cmd)
+			free_jobcmd(jc);
+	}
+	if ((any & ~flag & (JC_EXECUTE | JC_PLUS)) && (dryrun || quest || dotouch))
+		warning("'+' or $(MAKE) not on every line of recipe for %s: "
+				"not executing it", jp->j_name->n_name);
+
+	jc = jp->j_cmd;
+	jc->jc_next = NULL;
+	if (cmd) {
+		free(jc->jc_cmd);
+		jc->jc_cmd = cmd;
+		jc->jc_flag = flag;
+		if (echo && strcmp(echo, cmd) != 0)
+			jc->jc_echo = echo;
+		else
+			free(echo);
+	}
+}
+#endif
+
+/*
+ * Do commands to make a target.  The commands are expanded now, while
+ * the internal macros are set for this target.  If jobs are being run
+ * in parallel they're executed later: the target is marked as running
+ * and MAKE_DIDSOMETHING is returned.
+ */
+int
+docmds(struct name *np, struct cmd *cp)
+{
+	struct job *jp;
+	struct jobcmd *jc, **jcp;
+	char *q, *command;
+
+	jp = xmalloc(sizeof(struct job));
+	jp->j_next = NULL;
+	jp->j_name = np;
+	jp->j_cmd = NULL;
+	jp->j_pid = 0;
+	jp->j_estat = 0;
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	jp->j_start = (struct timespec){0, 0};
+#endif
+#if ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+	jp->j_out[0] = jp->j_out[1] = (struct output){NULL, 0, 0, -1};
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	jp->j_pool = np->n_pool;
+#endif
+#if ENABLE_FEATURE_MAKE_COSHELL
+	jp->j_coproc = NULL;
+#endif
+
+	jcp = &jp->j_cmd;
+	for (; cp; cp = cp->c_next) {
+		uint32_t ssilent, signore, sdomake;
+
+		// Location of command in makefile (for use in error messages)
+		makefile = cp->c_makefile;
+		dispno = cp->c_dispno;
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+		opts &= ~OPT_make;	// We want to know if $(MAKE) is expanded
+#endif
+		q = command = expand_command(cp);
+		ssilent = silent || (np->n_flag & N_SILENT) || dotouch;
+		signore = ignore || (np->n_flag & N_IGNORE);
+		sdomake = (!dryrun || doinclude || domake) && !dotouch;
+		for (;;) {
+			if (*q == '@')	// Specific silent
+				ssilent = TRUE + 1;
+			else if (*q == '-')	// Specific ignore
+				signore = TRUE;
+			else if (*q == '+')	// Specific domake
+				sdomake = TRUE + 1;
+			else
+				break;
+			do {
+				q++;
+			} while (isblank(*q));
+		}
+
+		if (sdomake > TRUE) {
+			// '+' must not override '@' or .SILENT
+			if (ssilent != TRUE + 1 && !(np->n_flag & N_SILENT))
+				ssilent = FALSE;
+		} else if (!sdomake)
+			ssilent = dotouch;
+
+		*jcp = jc = xmalloc(sizeof(struct jobcmd));
+		jc->jc_next = NULL;
+		jc->jc_cmd = memmove(command, q, strlen(q) + 1);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		jc->jc_echo = NULL;
+#endif
+		jc->jc_makefile = cp->c_makefile;
+		jc->jc_dispno = cp->c_dispno;
+		jc->jc_flag = (ssilent ? JC_SILENT : 0) | (signore ? JC_IGNORE : 0) |
+						(sdomake ? JC_EXECUTE : 0) |
+						(sdomake > TRUE ? JC_PLUS : 0) |
+						(domake || sdomake > TRUE ? JC_MAKE : 0);
+		jcp = &jc->jc_next;
+	}
+	makefile = NULL;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (oneshell && jp->j_cmd && jp->j_cmd->jc_next)
+		join_cmds(jp);
+#endif
+	np->n_flag |= N_RUNNING;
+
+#if !defined(_WIN32) && !defined(_WIN64)
+	if (maxjobs > 1 && !doinclude) {
+		queue_job(jp);
+		start_jobs();
+		return MAKE_DIDSOMETHING;
+	}
+#endif
+
+	// Run the job now and wait for it to finish
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	start_timer(jp);
+#endif
+	jp->j_next = running;
+	running = jp;
+	while (nextcmd(jp)) {
+#if !defined(_WIN32) && !defined(_WIN64)
+		struct rusage ru;
+		int status;
+
+#if ENABLE_FEATURE_MAKE_COSHELL
+		if (jp->j_coproc) {
+			coshell_status(jp, &status, TRUE);
+			memset(&ru, 0, sizeof(ru));
+		} else
+#endif
+			wait_child(jp->j_pid, &status, &ru);
+#if ENABLE_FEATURE_MAKE_RUSAGE
+		report_rusage(jp, status, &ru);
+#endif
+		endcmd(jp, status);
+		if (stopping)
+			exit(2);
+#endif
+	}
+	running = jp->j_next;
+	return endjob(jp);
+}
@@ -3,19 +3,61 @@
  */
 #include "make.h"
 
-struct macro *macrohead[HTABSIZE];
+// The hash table of macros starts with HTABSIZE buckets and grows as
+// macros are added.
+static struct macro *macrotab[HTABSIZE];
+struct macro **macrohead = macrotab;
+int macrosize = HTABSIZE;
+static int macrocount;
 
-struct macro *
-getmp(const char *name)
+// Saved expansions of macros are only valid if no macro has been set
+// since.  Internal macros are set for each target, so changes to them
+// are counted separately.
+unsigned int macrogen;
+unsigned int autogen;
+
+static struct macro *
+lookup_macro(const char *name, unsigned int hash)
 {
 	struct macro *mp;
 
-	for (mp = macrohead[getbucket(name)]; mp; mp = mp->m_next)
-		if (strcmp(name, mp->m_name) == 0)
+	for (mp = macrohead[hash % macrosize]; mp; mp = mp->m_next)
+		if (mp->m_hash == hash && strcmp(name, mp->m_name) == 0)
 			return mp;
 	return NULL;
 }
 
+struct macro *
+getmp(const char *name)
+{
+	return lookup_macro(name, gethash(name));
+}
+
+/*
+ * When there are more macros than buckets make the hash table about
+ * twice as big.
+ */
+static void
+grow_macros(void)
+{
+	struct macro **head, *mp, *nextmp;
+	int i, size = 2 * macrosize + 1;
+
+	head = xmalloc(size * sizeof(*head));
+	memset(head, 0, size * sizeof(*head));
+	for (i = 0; i < macrosize; i++) {
+		for (mp = macrohead[i]; mp; mp = nextmp) {
+			nextmp = mp->m_next;
+			mp->m_next = head[mp->m_hash % size];
+			head[mp->m_hash % size] = mp;
+		}
+	}
+	if (macrohead != macrotab)
+		free(macrohead);
+	macrohead = head;
+	macrosize = size;
+}
+
 static int
 is_valid_macro(const char *name)
 {
@@ -71,6 +113,7 @@ void
 setmacro(const char *name, const char *val, int level)
 {
 	struct macro *mp;
+	unsigned int hash = gethash(name);
 	bool valid = level & M_VALID;
 	bool from_env = level & M_ENVIRON;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
@@ -78,7 +121,7 @@ setmacro(const char *name, const char *val, int level)
 #endif
 
 	level &= ~(M_IMMEDIATE | M_VALID | M_ENVIRON);
-	mp = getmp(name);
+	mp = lookup_macro(name, hash);
 	if (mp) {
 		// Don't replace existing macro from a lower level
 		if (level > mp->m_level)
@@ -86,6 +129,8 @@ setmacro(const char *name, const char *val, int level)
 
 		// Replace existing macro
 		free(mp->m_val);
+		free_tmpl(mp->m_tmpl);
+		free(mp->m_cache);
 	} else {
 		// If not defined, allocate space for new
 		unsigned int bucket;
@@ -103,13 +148,26 @@ setmacro(const char *name, const char *val, int level)
 #endif
 		}
 
-		bucket = getbucket(name);
+		if (++macrocount > macrosize)
+			grow_macros();
+		bucket = hash % macrosize;
 		mp = xmalloc(sizeof(struct macro));
 		mp->m_next = macrohead[bucket];
 		macrohead[bucket] = mp;
+		mp->m_hash = hash;
 		mp->m_flag = FALSE;
 		mp->m_name = xstrdup(name);
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+		mp->m_count = 0;
+		mp->m_bytes = mp->m_nsec = 0;
+#endif
 	}
+	mp->m_tmpl = NULL;
+	mp->m_cache = NULL;
+	if (name[0] && name[1] == '\0' && strchr("@%?<*^+", name[0]))
+		autogen++;
+	else
+		macrogen++;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
 	mp->m_immediate = immediate;
 #endif
@@ -117,6 +175,59 @@ setmacro(const char *name, const char *val, int level)
 	mp->m_val = xstrdup(val ? val : "");
 }
 
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+static int
+cmp_stats(const void *a, const void *b)
+{
+	const struct macro *m1 = *(struct macro **)a;
+	const struct macro *m2 = *(struct macro **)b;
+
+	if (m1->m_nsec != m2->m_nsec)
+		return m1->m_nsec < m2->m_nsec ? 1 : -1;
+	return strcmp(m1->m_name, m2->m_name);
+}
+
+/*
+ * Append a report on the expansion of macros to the file named by
+ * PDPMAKE_MACROSTATS.  Each line gives a macro's name, the number of
+ * times it was expanded, the total length of the expansions and the
+ * time taken in seconds.  Macros which took longest are listed first.
+ * The report is also made on exit, so it's only written once.
+ */
+void
+report_macros(void)
+{
+	FILE *fp;
+	struct macro *mp, **list;
+	const char *name = macrostats;
+	int i, n = 0;
+
+	if (name == NULL)
+		return;
+	macrostats = NULL;
+	if ((fp = fopen(name, "a")) == NULL) {
+		warning("can't open %s: %s", name, strerror(errno));
+		return;
+	}
+
+	list = xmalloc(macrocount * sizeof(*list));
+	for (i = 0; i < macrosize; i++) {
+		for (mp = macrohead[i]; mp; mp = mp->m_next) {
+			if (mp->m_count)
+				list[n++] = mp;
+		}
+	}
+	qsort(list, n, sizeof(*list), cmp_stats);
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s\t%lu\t%llu\t%.6f\n", list[i]->m_name,
+					list[i]->m_count, (unsigned long long)list[i]->m_bytes,
+					list[i]->m_nsec / 1e9);
+	}
+	free(list);
+	fclose(fp);
+}
+#endif
+
 #if ENABLE_FEATURE_CLEAN_UP
 void
 freemacros(void)
@@ -124,13 +235,17 @@ freemacros(void)
 	int i;
 	struct macro *mp, *nextmp;
 
-	for (i = 0; i < HTABSIZE; i++) {
+	for (i = 0; i < macrosize; i++) {
 		for (mp = macrohead[i]; mp; mp = nextmp) {
 			nextmp = mp->m_next;
 			free(mp->m_name);
 			free(mp->m_val);
+			free_tmpl(mp->m_tmpl);
+			free(mp->m_cache);
 			free(mp);
 		}
 	}
+	if (macrohead != macrotab)
+		free(macrohead);
 }
 #endif
@@ -1,11 +1,14 @@
 /*
- * make [--posix] [-C path] [-f makefile] [-j num] [-x pragma]
+ * make [--posix] [-C path] [-f makefile] [-j num] [-l load] [-O type]
+ *      [-x pragma]
  *      [-ehiknpqrsSt] [macro[:[:[:]]]=val ...] [target ...]
  *
  *  --posix  Enforce POSIX mode (non-POSIX)
  *  -C  Change directory to path (non-POSIX)
  *  -f  Makefile name
- *  -j  Number of jobs to run in parallel (not implemented)
+ *  -j  Number of jobs to run in parallel
+ *  -l  Don't start jobs if the load average is too high (non-POSIX)
+ *  -O  Collect output of parallel jobs: none, line or target (non-POSIX)
  *  -x  Pragma to make POSIX mode less strict (non-POSIX)
  *  -e  Environment variables override macros in makefiles
  *  -h  Display help information (non-POSIX)
@@ -25,10 +28,17 @@ uint32_t opts;
 const char *myname;
 const char *makefile;
 struct file *makefiles;
+bool nomemo;
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+char *macrostats;
+#endif
+static struct file **mftail = &makefiles;
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 char *numjobs = NULL;
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
+char *maxload = NULL;
+static const char *outsync_types[] = {"none", "line", "target"};
 bool posix;
 bool seen_first;
 unsigned char pragma = 0;
@@ -46,6 +56,7 @@ usage(int exit_code)
 		IF_FEATURE_MAKE_EXTENSIONS(" [--posix] [-C path]")
 		" [-f makefile]"
 		IF_FEATURE_MAKE_POSIX_2024(" [-j num]")
+		IF_FEATURE_MAKE_EXTENSIONS(" [-l load] [-O type]")
 		IF_FEATURE_MAKE_EXTENSIONS(" [-x pragma]")
 		IF_FEATURE_MAKE_EXTENSIONS("\n\t")
 		IF_NOT_FEATURE_MAKE_EXTENSIONS(" [-eiknpqrsSt] ")
@@ -88,6 +99,43 @@ usage(int exit_code)
 	exit(exit_code);
 }
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Set the load average above which jobs aren't started from the
+ * argument of the '-l' option.
+ */
+static void
+set_maxload(const char *arg)
+{
+	char *s;
+
+	if (strtod(arg, &s) < 0 || s == arg || *s)
+		usage(2);
+	free(maxload);
+	maxload = xstrdup(arg);
+}
+
+/*
+ * Set how output from parallel jobs is collected from the argument
+ * of the '-O' option.  Unlike GNU make the argument is required.
+ */
+static void
+set_outsync(const char *arg)
+{
+	int i;
+
+	for (i = 0; strcmp(arg, outsync_types[i]) != 0; i++) {
+		if (i == OUTSYNC_TARGET) {
+			// GNU make's 'recurse' is treated like 'target'
+			if (strcmp(arg, "recurse") == 0)
+				break;
+			usage(2);
+		}
+	}
+	outsync = i;
+}
+#endif
+
 /*
  * Process options from an argv array.  If from_env is non-zero we're
  * handling options from MAKEFLAGS so skip '-C', '-f', '-p' and '-x'.
@@ -110,7 +158,7 @@ static uint32_t process_options(int argc, char **argv, int from_env) {
     }
     const char* fn = args_option_str("-f");
     if (fn) { // // Alternate file name
-        makefiles = newfile((char*)fn, makefiles);
+        mftail = newfile((char*)fn, mftail);
         flags |= OPT_f;
     }
     if (args_option_bool("-e")) {
@@ -134,6 +182,20 @@ static uint32_t process_options(int argc, char **argv, int from_env) {
         flags |=  OPT_k;
         flags &= ~OPT_S;
     }
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+    const char* load = args_option_str("-l");
+    if (load) { // Maximum load average
+        if (posix) { error("-l not allowed"); }
+        set_maxload(load);
+        flags |= OPT_l;
+    }
+    const char* sync = args_option_str("-O");
+    if (sync) { // Synchronise output of parallel jobs
+        if (posix) { error("-O not allowed"); }
+        set_outsync(sync);
+        flags |= OPT_O;
+    }
+#endif
     if (args_option_bool("-n")) { // Pretend mode
         flags |= OPT_n;
     }
@@ -182,7 +244,7 @@ process_options(int argc, char **argv, int from_env)
 #endif
 		case 'f':	// Alternate file name
 			if (!from_env) {
-				makefiles = newfile(optarg, makefiles);
+				mftail = newfile(optarg, mftail);
 				flags |= OPT_f;
 			}
 			break;
@@ -221,6 +283,24 @@ process_options(int argc, char **argv, int from_env)
 			flags |= OPT_k;
 			flags &= ~OPT_S;
 			break;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		case 'l':	// Maximum load average
+			if (!posix) {
+				set_maxload(optarg);
+				flags |= OPT_l;
+				break;
+			}
+			error("-l not allowed");
+			break;
+		case 'O':	// Synchronise output of parallel jobs
+			if (!posix) {
+				set_outsync(optarg);
+				flags |= OPT_O;
+				break;
+			}
+			error("-O not allowed");
+			break;
+#endif
 		case 'n':	// Pretend mode
 			flags |= OPT_n;
 			break;
@@ -264,6 +344,27 @@ process_options(int argc, char **argv, int from_env)
 
 #endif
 
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+/*
+ * If an argument from MAKEFLAGS describes a jobserver save the details
+ * and return TRUE.  GNU make has used both forms.
+ */
+static int
+jobserver_arg(const char *arg)
+{
+	const char *s;
+
+	if ((s = strchr(arg, '=')) &&
+			(strncmp(arg, "--jobserver-auth=", s - arg + 1) == 0 ||
+			strncmp(arg, "--jobserver-fds=", s - arg + 1) == 0)) {
+		free(jobserver_auth);
+		jobserver_auth = xstrdup(s + 1);
+		return TRUE;
+	}
+	return FALSE;
+}
+#endif
+
 /*
  * Split the contents of MAKEFLAGS into an argv array.  If the return
  * value (call it fargv) isn't NULL the caller should free fargv[1] and
@@ -297,6 +398,12 @@ expand_makeflags(int *fargc)
 			error("invalid MAKEFLAGS");
 		*p++ = '-';
 	} else {
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+		// GNU make omits the hyphen from an initial word of options
+		size_t len = strcspn(makeflags, " \t");
+		if (makeflags[0] != '-' && strspn(makeflags, OPTSTR1 + 1) == len)
+			*p++ = '-';
+#endif
 		// MAKEFLAGS may need to be split, estimate size of argv array.
 		for (m = makeflags; *m; ++m) {
 			if (isblank(*m))
@@ -317,6 +424,10 @@ expand_makeflags(int *fargc)
 		else if (isblank(*m)) {
 			// Terminate current argument and start a new one.
 			*p++ = '\0';
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+			if (jobserver_arg(argv[argc - 1]))
+				p = argv[--argc];
+#endif
 			argv[argc++] = p;
 			do {
 				m++;
@@ -326,6 +437,13 @@ expand_makeflags(int *fargc)
 		*p++ = *m++;
 	} while (*m != '\0');
 	*p = '\0';
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+	if (jobserver_arg(argv[argc - 1]) && --argc == 1) {
+		free(argstr);
+		free(argv);
+		return NULL;
+	}
+#endif
 	argv[argc] = NULL;
 
 	*fargc = argc;
@@ -448,7 +566,7 @@ update_makeflags(void)
 
 	t = OPTSTR1 + 1;
 	for (i = 0; *t; t++) {
-#if ENABLE_FEATURE_MAKE_POSIX_2024
+#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
 		if (*t == ':')
 			continue;
 #endif
@@ -459,12 +577,19 @@ update_makeflags(void)
 			if (*t == 'j') {
 				makeflags = xappendword(makeflags, numjobs);
 			}
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (*t == 'l') {
+				makeflags = xappendword(makeflags, maxload);
+			} else if (*t == 'O') {
+				makeflags = xappendword(makeflags, outsync_types[outsync]);
+			}
 #endif
 		}
 		i++;
 	}
 
-	for (i = 0; i < HTABSIZE; ++i) {
+	for (i = 0; i < macrosize; ++i) {
 		for (mp = macrohead[i]; mp; mp = mp->m_next) {
 			if ((mp->m_level == 1 || mp->m_level == 2) &&
 					strcmp(mp->m_name, "MAKEFLAGS") != 0) {
@@ -533,6 +658,8 @@ mark_special(const char *special, uint32_t oflag, uint16_t nflag)
 	if (!(opts & oflag) && (np = findname(special))) {
 		for (rp = np->n_rule; rp; rp = rp->r_next) {
 			for (dp = rp->r_dep; dp; dp = dp->d_next) {
+				if ((dp->d_name->n_flag & N_WAIT))
+					continue;
 				dp->d_name->n_flag |= nflag;
 				marked = TRUE;
 			}
@@ -553,7 +680,11 @@ main(int argc, char **argv)
 #endif
 	char **fargv, **fargv0;
 	int fargc, estat;
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+	uint32_t cmdopts;
+#endif
 	bool found_target;
+	struct name **goals, **gp;
 	FILE *ifd;
 	struct file *fp;
 
@@ -600,7 +731,11 @@ main(int argc, char **argv)
 	}
 
 	// Process options from the command line
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+	opts |= cmdopts = process_options(argc, argv, FALSE);
+#else
 	opts |= process_options(argc, argv, FALSE);
+#endif
 #if defined(_WIN32) || defined(_WIN64)
     argv = args.v;
     argc = args.c;
@@ -614,6 +749,19 @@ main(int argc, char **argv)
 #endif
 	init_signal(SIGTERM);
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	nomemo = getenv("PDPMAKE_NOMEMO") != NULL;
+#endif
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+	macrostats = getenv("PDPMAKE_MACROSTATS");
+	if (macrostats && *macrostats == '\0')
+		macrostats = NULL;
+	if (macrostats) {
+		// Reused expansions would hide the cost of nested macros
+		nomemo = TRUE;
+		atexit(report_macros);
+	}
+#endif
 	setmacro("$", "$", 0 | M_VALID);
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -701,6 +849,9 @@ main(int argc, char **argv)
 		fclose(ifd);
 		makefile = NULL;
 	}
+#if ENABLE_FEATURE_MAKE_SHELL_CACHE
+	save_shell_cache();
+#endif
 
 	if (print)
 		print_details();
@@ -711,6 +862,32 @@ main(int argc, char **argv)
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 	if (!POSIX_2017)
 		mark_special(".PHONY", OPT_phony, N_PHONY);
+# if !defined(_WIN32) && !defined(_WIN64)
+	// Run jobs in parallel unless the makefile forbids it
+	if (numjobs && !POSIX_2017 && !findname(".NOTPARALLEL")) {
+		long n = strtol(numjobs, NULL, 10);
+		maxjobs = n > INT_MAX ? INT_MAX : n > 1 ? (int)n : 1;
+	}
+# endif
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (maxload)
+		loadlimit = strtod(maxload, NULL);
+	oneshell = !posix && findname(".ONESHELL") != NULL;
+	if (maxjobs > 1 && !posix)
+		init_pools();
+#endif
+#if ENABLE_FEATURE_MAKE_COSHELL
+	coshell = !posix && getenv("PDPMAKE_COSHELL") != NULL;
+#endif
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+	if (!posix)
+		jobserver_init(cmdopts & OPT_j);
+#endif
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	if (maxjobs > 1 && !posix && !dryrun && !quest && !dotouch &&
+			getenv("PDPMAKE_JOBTIMES"))
+		load_times(makefiles ? makefiles->f_name : ".");
 #endif
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -727,30 +904,44 @@ main(int argc, char **argv)
 		}
 	}
 
-	estat = 0;
-	found_target = FALSE;
+	// Make all the goals together, so they can be made in parallel
+	for (fargc = 0; argv[fargc]; fargc++)
+		;
+	gp = goals = xmalloc((fargc + 2) * sizeof(struct name *));
 	for (; *argv; argv++) {
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 		// Skip macro assignments.
 		if (strchr(*argv, '='))
 			continue;
 #endif
-		found_target = TRUE;
-		estat |= make(newname(*argv), 0);
+		*gp++ = newname(*argv);
 	}
-	if (!found_target) {
+	if (gp == goals) {
 		if (!firstname)
 			error("no targets defined");
-		estat = make(firstname, 0);
+		*gp++ = firstname;
 	}
+	*gp = NULL;
+	estat = make_goals(goals, 0);
+	free(goals);
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	save_times();
+#endif
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+	report_macros();
+#endif
 
 #if ENABLE_FEATURE_CLEAN_UP
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 	free((void *)numjobs);
+# endif
+# if ENABLE_FEATURE_MAKE_EXTENSIONS
+	free(maxload);
 # endif
 	freenames();
 	freemacros();
 	freefiles(makefiles);
+	freearena();
 #endif
 
 	return estat & MAKE_FAILURE;
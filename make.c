@@ -3,164 +3,16 @@
  */
 #include "make.h"
 
-struct name *target;
-
-void
-remove_target(void)
-{
-	if (!dryrun && !print && !precious &&
-			target && !(target->n_flag & (N_PRECIOUS | N_PHONY)) &&
-			unlink(target->n_name) == 0) {
-		diagnostic("'%s' removed", target->n_name);
-	}
-}
-
-/*
- * Update the modification time of a file to now.
- */
-static void
-touch(struct name *np)
-{
-	if (dryrun || !silent)
-		printf("touch %s\n", np->n_name);
-
-	if (!dryrun) {
-		const struct timespec timebuf[2] = {{0, UTIME_NOW}, {0, UTIME_NOW}};
-
-		if (utimensat(AT_FDCWD, np->n_name, timebuf, 0) < 0) {
-			if (errno == ENOENT) {
-				int fd = open(np->n_name, O_RDWR | O_CREAT, 0666);
-				if (fd >= 0) {
-					close(fd);
-					return;
-				}
-			}
-			warning("touch %s failed: %s\n", np->n_name, strerror(errno));
-		}
-	}
-}
-
 /*
- * Do commands to make a target
+ * Update the modification time of a target after its commands have
+ * been run.  If the file doesn't exist assume it was made just now.
  */
-static int
-docmds(struct name *np, struct cmd *cp)
+void
+update_time(struct name *np)
 {
-	int estat = 0;
-	char *q, *command;
-
-	for (; cp; cp = cp->c_next) {
-		uint32_t ssilent, signore, sdomake;
-
-		// Location of command in makefile (for use in error messages)
-		makefile = cp->c_makefile;
-		dispno = cp->c_dispno;
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-		opts &= ~OPT_make;	// We want to know if $(MAKE) is expanded
-#endif
-		q = command = expand_macros(cp->c_cmd, FALSE);
-		ssilent = silent || (np->n_flag & N_SILENT) || dotouch;
-		signore = ignore || (np->n_flag & N_IGNORE);
-		sdomake = (!dryrun || doinclude || domake) && !dotouch;
-		for (;;) {
-			if (*q == '@')	// Specific silent
-				ssilent = TRUE + 1;
-			else if (*q == '-')	// Specific ignore
-				signore = TRUE;
-			else if (*q == '+')	// Specific domake
-				sdomake = TRUE + 1;
-			else
-				break;
-			do {
-				q++;
-			} while (isblank(*q));
-		}
-
-		if (sdomake > TRUE) {
-			// '+' must not override '@' or .SILENT
-			if (ssilent != TRUE + 1 && !(np->n_flag & N_SILENT))
-				ssilent = FALSE;
-		} else if (!sdomake)
-			ssilent = dotouch;
-
-		if (!ssilent && *q != '\0') {	// Ignore empty commands
-			puts(q);
-			fflush(stdout);
-		}
-
-		if (quest && sdomake != TRUE + 1) {
-			// MAKE_FAILURE means rebuild is needed
-			estat |= MAKE_FAILURE | MAKE_DIDSOMETHING;
-			continue;
-		}
-
-		if (sdomake && *q != '\0') {	// Ignore empty commands
-			// Get the shell to execute it
-			int status;
-			char *cmd = !signore IF_FEATURE_MAKE_EXTENSIONS(&& posix) ?
-							xconcat3("set -e;", q, "") : q;
-			target = np;
-            #if defined(WIN32) || defined(WIN64)
-			status = win32_system_via_sh(cmd);
-            #else
-			status = system(cmd);
-            #endif
-			if (!signore IF_FEATURE_MAKE_EXTENSIONS(&& posix))
-				free(cmd);
-			// If this command was being run to create an include file
-			// or bring it up-to-date errors should be ignored and a
-			// failure status returned.
-			if (status == -1 && !doinclude) {
-				error("couldn't execute '%s'", q);
-			} else if (status != 0 && !signore) {
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-				if (!posix && WIFSIGNALED(status))
-					remove_target();
-#endif
-				if (doinclude) {
-					warning("failed to build '%s'", np->n_name);
-				} else {
-					const char *err_type = NULL;
-					int err_value = 1;
-
-					if (WIFEXITED(status)) {
-						err_type = "exit";
-						err_value = WEXITSTATUS(status);
-					} else if (WIFSIGNALED(status)) {
-						err_type = "signal";
-						err_value = WTERMSIG(status);
-					}
-
-					if (!quest || err_value == 127) {
-						if (err_type)
-							diagnostic("failed to build '%s' %s %d",
-									np->n_name, err_type, err_value);
-						else
-							diagnostic("failed to build '%s'", np->n_name);
-					}
-
-					if (errcont) {
-						estat |= MAKE_FAILURE;
-						free(command);
-						break;
-					}
-					exit(2);
-				}
-			}
-			target = NULL;
-		}
-		if (sdomake || dryrun)
-			estat = MAKE_DIDSOMETHING;
-		free(command);
-	}
-
-	if (dotouch && !(np->n_flag & N_PHONY) && !(estat & MAKE_DIDSOMETHING)) {
-		touch(np);
-		estat = MAKE_DIDSOMETHING;
-	}
-
-	makefile = NULL;
-	return estat;
+	modtime(np);
+	if (!np->n_tim.tv_sec)
+		clock_gettime(CLOCK_REALTIME, &np->n_tim);
 }
 
 #if !ENABLE_FEATURE_MAKE_POSIX_2024
@@ -171,18 +23,26 @@ make1(struct name *np, struct cmd *cp, char *oodate, char *allsrc,
 		char *dedup, struct name *implicit)
 {
 	char *name, *member = NULL, *base = NULL, *prereq = NULL;
+	int need = auto_macros(cp);
 
+	// Only set the internal macros the commands refer to
 	name = splitlib(np->n_name, &member);
-	setmacro("?", oodate, 0 | M_VALID);
+	if ((need & A_OODATE))
+		setmacro("?", oodate, 0 | M_VALID);
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 	if (!POSIX_2017) {
-		setmacro("+", allsrc, 0 | M_VALID);
-		setmacro("^", dedup, 0 | M_VALID);
+		if ((need & A_ALLSRC))
+			setmacro("+", allsrc, 0 | M_VALID);
+		if ((need & A_DEDUP))
+			setmacro("^", dedup, 0 | M_VALID);
 	}
 #endif
-	setmacro("%", member, 0 | M_VALID);
-	setmacro("@", name, 0 | M_VALID);
-	if (implicit IF_FEATURE_MAKE_EXTENSIONS(|| !posix)) {
+	if ((need & A_MEMBER))
+		setmacro("%", member, 0 | M_VALID);
+	if ((need & A_TARGET))
+		setmacro("@", name, 0 | M_VALID);
+	if ((need & (A_PREREQ | A_BASE)) &&
+			(implicit IF_FEATURE_MAKE_EXTENSIONS(|| !posix))) {
 		char *s;
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -211,8 +71,10 @@ make1(struct name *np, struct cmd *cp, char *oodate, char *allsrc,
 #endif
 			*s = '\0';
 	}
-	setmacro("<", prereq, 0 | M_VALID);
-	setmacro("*", base, 0 | M_VALID);
+	if ((need & A_PREREQ))
+		setmacro("<", prereq, 0 | M_VALID);
+	if ((need & A_BASE))
+		setmacro("*", base, 0 | M_VALID);
 	free(name);
 
 	return docmds(np, cp);
@@ -245,48 +107,211 @@ timespec_max(const struct timespec *t, const struct timespec *p)
 	return timespec_le(t, p) ? p : t;
 }
 
+// Progress of a target being made
+enum {
+	MK_START,		// Find the rules and commands to use
+	MK_DEPS,		// Make prerequisites of single-colon rules
+	MK_DEPSMADE,	// Prerequisites of single-colon rules have been made
+	MK_RULE,		// Process the next rule
+	MK_RULEDEPS,	// Make prerequisites of a double-colon rule
+	MK_RULEJOB,		// Wait for a double-colon rule's commands to finish
+	MK_JOB,			// Wait for the target's commands to finish
+	MK_DONE			// Finished
+};
+
+// A target waiting for another to be made
+struct mkwait {
+	struct mkwait *w_next;
+	struct mkstate *w_state;
+};
+
+// State of a target being made.  Those whose prerequisites are being
+// made form a stack, in place of recursion.  When jobs are run in
+// parallel a target whose prerequisites are still being made is set
+// aside until they're finished, so other targets can proceed.
+struct mkstate {
+	struct mkstate *s_parent;	// Target which needs this one
+	struct mkstate *s_next;		// Next target ready to continue
+	struct mkwait *s_waiting;	// Targets waiting for this one
+	struct name *s_name;		// Target being made
+	int s_level;				// Depth below the goal
+	int s_phase;				// One of the MK_* values
+	int s_estat;				// Exit status
+	int s_pending;				// Prerequisites not yet made
+	bool s_parked;				// Set aside until prerequisites are made
+	int *s_result;				// Where the goal's status is returned
+	struct rule *s_rule;		// Current rule
+	struct depend *s_dep;		// Next prerequisite of current rule
+	struct name *s_impdep;		// Implicit prerequisite
+	struct rule s_imprule;		// Inference rule used
+	struct cmd *s_sccmd;		// Commands for single-colon rule
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct name *s_locdep;		// Implicit prerequisite of double-colon rule
+#endif
+	struct timespec s_dtim;		// Time of newest prerequisite
+	struct strbuf s_oodate;		// $?
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	struct strbuf s_allsrc;		// $+
+	struct strbuf s_dedup;		// $^
+#endif
+};
+
+// Targets set aside whose prerequisites have now been made
+static struct mkstate *readyhead;
+static struct mkstate **readytail = &readyhead;
+
 /*
- * Recursive routine to make a target.
+ * Let a target which was set aside continue.
  */
-int
-make(struct name *np, int level)
+static void
+make_ready(struct mkstate *sp)
+{
+	sp->s_parked = FALSE;
+	sp->s_next = NULL;
+	*readytail = sp;
+	readytail = &sp->s_next;
+}
+
+/*
+ * Note that a target has to wait for another, which is being made,
+ * to be finished.
+ */
+static void
+wait_for(struct mkstate *sp, struct mkstate *dep)
+{
+	struct mkwait *wp = xmalloc(sizeof(struct mkwait));
+
+	wp->w_state = sp;
+	wp->w_next = dep->s_waiting;
+	dep->s_waiting = wp;
+	sp->s_pending++;
+}
+
+/*
+ * A target has been made.  Pass its status to the targets waiting
+ * for it and let any with no other prerequisites pending continue.
+ */
+static void
+finish_state(struct mkstate *sp)
+{
+	struct mkwait *wp, *next;
+	struct mkstate *waiter;
+	int estat = sp->s_estat;
+
+	if ((sp->s_name->n_flag & N_FAILED))
+		estat |= MAKE_FAILURE;
+	sp->s_name->n_state = NULL;
+	if (sp->s_result)
+		*sp->s_result = estat;
+	for (wp = sp->s_waiting; wp; wp = next) {
+		next = wp->w_next;
+		waiter = wp->w_state;
+		waiter->s_estat |= estat;
+		if (--waiter->s_pending == 0 && waiter->s_parked)
+			make_ready(waiter);
+		free(wp);
+	}
+	free(sp);
+}
+
+/*
+ * The commands to make a target in the background have finished.
+ * Either the target has been made or, for a double-colon rule, it
+ * can continue with the next rule.
+ */
+void
+job_finished(struct name *np)
+{
+	struct mkstate *sp = np->n_state;
+
+	if (sp && sp->s_phase == MK_JOB)
+		finish_state(sp);
+	else if (sp && sp->s_phase == MK_RULEJOB && sp->s_parked)
+		make_ready(sp);
+}
+
+/*
+ * Return the next prerequisite of the current rule which has to be
+ * made, or NULL if there are no more.  Prerequisites which are being
+ * made for other targets are waited for.  Those following a .WAIT
+ * aren't started until all those preceding it have been completed:
+ * s_dep is left pointing at the .WAIT until they are.
+ */
+static struct name *
+next_dep(struct mkstate *sp)
 {
 	struct depend *dp;
+	struct name *np;
+
+	while ((dp = sp->s_dep) != NULL) {
+		np = dp->d_name;
+		if ((np->n_flag & N_WAIT)) {
+			if (sp->s_pending)
+				return NULL;
+		} else if (np->n_state && !(np->n_flag & N_DOING)) {
+			wait_for(sp, np->n_state);
+		} else if (!(np->n_flag & N_DONE)) {
+			sp->s_dep = dp->d_next;
+			return np;
+		} else if (maxjobs > 1 && (np->n_flag & N_FAILED)) {
+			sp->s_estat |= MAKE_FAILURE;
+		}
+		sp->s_dep = dp->d_next;
+	}
+	return NULL;
+}
+
+/*
+ * Reset the flag used to detect duplicate prerequisites.
+ */
+static void
+unmark_deps(struct rule *rp)
+{
+#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
+	struct depend *dp;
+
+	for (dp = rp->r_dep; dp; dp = dp->d_next) {
+		dp->d_name->n_flag &= ~N_MARK;
+	}
+#endif
+}
+
+/*
+ * Find the commands for a target.  Return FALSE if it can't be made.
+ */
+static int
+find_rules(struct mkstate *sp)
+{
+	struct name *np = sp->s_name;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
 	struct rule *rp;
-	struct name *impdep = NULL;	// implicit prerequisite
-	struct rule imprule = {0};
-	struct cmd *sc_cmd = NULL;	// commands for single-colon rule
-	char *oodate = NULL;
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-	char *allsrc = NULL;
-	char *dedup = NULL;
 #endif
-	struct timespec dtim = {1, 0};
-	int estat = 0;
 
-	if (np->n_flag & N_DONE)
-		return 0;
-	if (np->n_flag & N_DOING)
-		error("circular dependency for %s", np->n_name);
-	np->n_flag |= N_DOING;
+#if ENABLE_FEATURE_MAKE_PREFETCH
+	if (!doinclude && !posix && (sp->s_level == 0 || stale_time(np)))
+		prefetch_times(np);
+#endif
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	if (sp->s_level == 0 && !doinclude)
+		plan_jobs(np);
+#endif
 
-	if (!np->n_tim.tv_sec)
-		modtime(np);		// Get modtime of this file
+	need_time(np);		// Get modtime of this file
 
 	if (!(np->n_flag & N_DOUBLE)) {
 		// Find the commands needed for a single-colon rule, using
 		// an inference rule or .DEFAULT rule if necessary (but,
 		// as an extension, not for phony targets)
-		sc_cmd = getcmd(np);
-		if (!sc_cmd
+		sp->s_sccmd = getcmd(np);
+		if (!sp->s_sccmd
 #if ENABLE_FEATURE_MAKE_EXTENSIONS && ENABLE_FEATURE_MAKE_POSIX_2024
 				&& (posix || !(np->n_flag & N_PHONY))
 #endif
 				) {
-			impdep = dyndep(np, &imprule);
-			if (impdep) {
-				sc_cmd = imprule.r_cmd;
-				addrule(np, imprule.r_dep, NULL, FALSE);
+			sp->s_impdep = dyndep(np, &sp->s_imprule);
+			if (sp->s_impdep) {
+				sp->s_sccmd = sp->s_imprule.r_cmd;
+				addrule(np, sp->s_imprule.r_dep, NULL, FALSE);
 			}
 		}
 
@@ -295,13 +320,13 @@ make(struct name *np, int level)
 #if ENABLE_FEATURE_MAKE_EXTENSIONS && ENABLE_FEATURE_MAKE_POSIX_2024
 			if (posix || !(np->n_flag & N_PHONY))
 #endif
-				sc_cmd = getcmd(findname(".DEFAULT"));
-			if (!sc_cmd) {
+				sp->s_sccmd = getcmd(findname(".DEFAULT"));
+			if (!sp->s_sccmd) {
 				if (doinclude)
-					return 1;
+					return FALSE;
 				error("don't know how to make %s", np->n_name);
 			}
-			impdep = np;
+			sp->s_impdep = np;
 		}
 	}
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -313,10 +338,10 @@ make(struct name *np, int level)
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 				if (posix || !(np->n_flag & N_PHONY))
 # endif
-					impdep = dyndep(np, &imprule);
-				if (!impdep) {
+					sp->s_impdep = dyndep(np, &sp->s_imprule);
+				if (!sp->s_impdep) {
 					if (doinclude)
-						return 1;
+						return FALSE;
 					error("don't know how to make %s", np->n_name);
 				}
 				break;
@@ -324,117 +349,328 @@ make(struct name *np, int level)
 		}
 	}
 #endif
+	return TRUE;
+}
 
-#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
-	// Reset flag to detect duplicate prerequisites
-	if (!(np->n_flag & N_DOUBLE)) {
-		for (rp = np->n_rule; rp; rp = rp->r_next) {
-			for (dp = rp->r_dep; dp; dp = dp->d_next) {
-				dp->d_name->n_flag &= ~N_MARK;
-			}
-		}
-	}
-#endif
-
-	for (rp = np->n_rule; rp; rp = rp->r_next) {
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-		struct name *locdep = NULL;
+/*
+ * Note the prerequisites of the current rule, whose prerequisites have
+ * been made.  A double-colon rule's commands are run if it's out of date.
+ */
+static void
+end_rule(struct mkstate *sp)
+{
+	struct name *np = sp->s_name;
+	struct rule *rp = sp->s_rule;
+	struct depend *dp;
+	int need;
 
-		// Each double-colon rule is handled separately.
-		if ((np->n_flag & N_DOUBLE)) {
-			// If the rule has no commands use the inference rule.
-			if (!rp->r_cmd) {
-				locdep = impdep;
-				imprule.r_dep->d_next = rp->r_dep;
-				rp->r_dep = imprule.r_dep;
-				rp->r_cmd = imprule.r_cmd;
-			}
-			// A rule with no prerequisites is executed unconditionally.
-			if (!rp->r_dep)
-				dtim = np->n_tim;
-			// Reset flag to detect duplicate prerequisites
-			for (dp = rp->r_dep; dp; dp = dp->d_next) {
-				dp->d_name->n_flag &= ~N_MARK;
-			}
-		}
-#endif
-		for (dp = rp->r_dep; dp; dp = dp->d_next) {
-			// Make prerequisite
-			estat |= make(dp->d_name, level + 1);
-
-			// Make strings of out-of-date prerequisites (for $?),
-			// all prerequisites (for $+) and deduplicated prerequisites
-			// (for $^).
-			if (timespec_le(&np->n_tim, &dp->d_name->n_tim)) {
+	need = auto_macros((np->n_flag & N_DOUBLE) ? rp->r_cmd : sp->s_sccmd);
+	for (dp = rp->r_dep; dp; dp = dp->d_next) {
+		if ((dp->d_name->n_flag & N_WAIT))
+			continue;
+		// Make strings of out-of-date prerequisites (for $?),
+		// all prerequisites (for $+) and deduplicated prerequisites
+		// (for $^), if the commands use them.  Only the first
+		// out-of-date prerequisite is needed for $<.
+		if (timespec_le(&np->n_tim, &dp->d_name->n_tim) &&
+				((need & A_OODATE) ||
+					((need & A_PREREQ) && !sp->s_oodate.sb_len))) {
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-				if (posix || !(dp->d_name->n_flag & N_MARK))
+			if (posix || !(dp->d_name->n_flag & N_MARK))
 #endif
-					oodate = xappendword(oodate, dp->d_name->n_name);
-			}
+				sb_appendword(&sp->s_oodate, dp->d_name->n_name);
+		}
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-			allsrc = xappendword(allsrc, dp->d_name->n_name);
-			if (!(dp->d_name->n_flag & N_MARK))
-				dedup = xappendword(dedup, dp->d_name->n_name);
+		if ((need & A_ALLSRC))
+			sb_appendword(&sp->s_allsrc, dp->d_name->n_name);
+		if ((need & A_DEDUP) && !(dp->d_name->n_flag & N_MARK))
+			sb_appendword(&sp->s_dedup, dp->d_name->n_name);
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
-			dp->d_name->n_flag |= N_MARK;
+		dp->d_name->n_flag |= N_MARK;
 #endif
-			dtim = *timespec_max(&dtim, &dp->d_name->n_tim);
-		}
+		sp->s_dtim = *timespec_max(&sp->s_dtim, &dp->d_name->n_tim);
+	}
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-		if ((np->n_flag & N_DOUBLE)) {
-			if (((np->n_flag & N_PHONY) || timespec_le(&np->n_tim, &dtim))) {
-				if (!(estat & MAKE_FAILURE)) {
-					estat |= make1(np, rp->r_cmd, oodate, allsrc,
-										dedup, locdep);
-					dtim = (struct timespec){1, 0};
-				}
-				free(oodate);
-				oodate = NULL;
+	if ((np->n_flag & N_DOUBLE)) {
+		if (((np->n_flag & N_PHONY) || timespec_le(&np->n_tim, &sp->s_dtim))) {
+			if (!(sp->s_estat & MAKE_FAILURE)) {
+				sp->s_estat |= make1(np, rp->r_cmd, sp->s_oodate.sb_buf,
+							sp->s_allsrc.sb_buf, sp->s_dedup.sb_buf,
+							sp->s_locdep);
+				sp->s_dtim = (struct timespec){1, 0};
 			}
+			free(sp->s_oodate.sb_buf);
+			sp->s_oodate = (struct strbuf){0};
+		}
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-			free(allsrc);
-			free(dedup);
-			allsrc = dedup = NULL;
+		free(sp->s_allsrc.sb_buf);
+		free(sp->s_dedup.sb_buf);
+		sp->s_allsrc = sp->s_dedup = (struct strbuf){0};
 #endif
-			if (locdep) {
-				rp->r_dep = rp->r_dep->d_next;
-				rp->r_cmd = NULL;
-			}
+		if (sp->s_locdep) {
+			rp->r_dep = rp->r_dep->d_next;
+			rp->r_cmd = NULL;
 		}
-#endif
 	}
+#endif
+}
+
+/*
+ * All the rules of a target have been processed.  Run the commands of
+ * a single-colon rule if it's out of date.
+ */
+static void
+end_target(struct mkstate *sp)
+{
+	struct name *np = sp->s_name;
+	int level = sp->s_level;
+
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-	if ((np->n_flag & N_DOUBLE) && impdep)
-		free(imprule.r_dep);
+	if ((np->n_flag & N_DOUBLE) && sp->s_impdep) {
+		sp->s_imprule.r_dep->d_next = NULL;
+		freedeps(sp->s_imprule.r_dep);
+	}
 #endif
 
 	np->n_flag |= N_DONE;
 	np->n_flag &= ~N_DOING;
 
 	if (!(np->n_flag & N_DOUBLE) &&
-				((np->n_flag & N_PHONY) || (timespec_le(&np->n_tim, &dtim)))) {
-		if (!(estat & MAKE_FAILURE)) {
-			if (sc_cmd)
-				estat |= make1(np, sc_cmd, oodate, allsrc, dedup, impdep);
-			else if (!doinclude && level == 0 && !(estat & MAKE_DIDSOMETHING))
+			((np->n_flag & N_PHONY) || (timespec_le(&np->n_tim, &sp->s_dtim)))) {
+		if (!(sp->s_estat & MAKE_FAILURE)) {
+			if (sp->s_sccmd)
+				sp->s_estat |= make1(np, sp->s_sccmd, sp->s_oodate.sb_buf,
+							sp->s_allsrc.sb_buf, sp->s_dedup.sb_buf,
+							sp->s_impdep);
+			else if (!doinclude && level == 0 &&
+						!(sp->s_estat & MAKE_DIDSOMETHING))
 				warning("nothing to be done for %s", np->n_name);
 		} else if (!doinclude && !quest) {
 			diagnostic("'%s' not built due to errors", np->n_name);
 		}
-		free(oodate);
 	}
 
-	if (estat & MAKE_DIDSOMETHING) {
-		modtime(np);
-		if (!np->n_tim.tv_sec)
-			clock_gettime(CLOCK_REALTIME, &np->n_tim);
-	} else if (!quest && level == 0 && !timespec_le(&np->n_tim, &dtim))
+	if ((np->n_flag & N_RUNNING)) {
+		// The target's commands are being run in the background.  Its
+		// modification time will be updated when they've finished.
+		sp->s_phase = MK_JOB;
+	} else if (sp->s_estat & MAKE_DIDSOMETHING) {
+		update_time(np);
+	} else if (!quest && level == 0 && !timespec_le(&np->n_tim, &sp->s_dtim))
 		printf("%s: '%s' is up to date\n", myname, np->n_name);
 
+	free(sp->s_oodate.sb_buf);
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-	free(allsrc);
-	free(dedup);
+	free(sp->s_allsrc.sb_buf);
+	free(sp->s_dedup.sb_buf);
 #endif
+}
+
+/*
+ * Continue making a target.  Return a prerequisite which must be made
+ * before it can proceed, or NULL when the target can't proceed.  It
+ * has then either been finished, or is waiting for prerequisites or
+ * its commands.
+ */
+static struct name *
+make_step(struct mkstate *sp)
+{
+	struct name *np = sp->s_name, *dep;
+	struct rule *rp;
+
+	for (;;) {
+		switch (sp->s_phase) {
+		case MK_START:
+			if (!find_rules(sp)) {
+				sp->s_estat = 1;
+				sp->s_phase = MK_DONE;
+				return NULL;
+			}
+			sp->s_rule = np->n_rule;
+			sp->s_dep = sp->s_rule ? sp->s_rule->r_dep : NULL;
+			sp->s_phase = (np->n_flag & N_DOUBLE) ? MK_RULE : MK_DEPS;
+			break;
+		case MK_DEPS:
+			// Make prerequisites, waiting at a .WAIT for those before it
+			if ((dep = next_dep(sp)) || sp->s_dep)
+				return dep;
+			if (sp->s_rule && (sp->s_rule = sp->s_rule->r_next)) {
+				sp->s_dep = sp->s_rule->r_dep;
+				break;
+			}
+			sp->s_phase = MK_DEPSMADE;
+			if (sp->s_pending)
+				return NULL;
+			break;
+		case MK_DEPSMADE:
+			for (rp = np->n_rule; rp; rp = rp->r_next)
+				unmark_deps(rp);
+			sp->s_rule = np->n_rule;
+			sp->s_phase = MK_RULE;
+			break;
+		case MK_RULE:
+			if ((rp = sp->s_rule) == NULL) {
+				sp->s_phase = MK_DONE;
+				end_target(sp);
+				return NULL;
+			}
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			// Each double-colon rule is handled separately.
+			sp->s_locdep = NULL;
+			if ((np->n_flag & N_DOUBLE)) {
+				// If the rule has no commands use the inference rule.
+				if (!rp->r_cmd) {
+					sp->s_locdep = sp->s_impdep;
+					sp->s_imprule.r_dep->d_next = rp->r_dep;
+					rp->r_dep = sp->s_imprule.r_dep;
+					rp->r_cmd = sp->s_imprule.r_cmd;
+				}
+				// A rule with no prerequisites is executed unconditionally.
+				if (!rp->r_dep)
+					sp->s_dtim = np->n_tim;
+				sp->s_dep = rp->r_dep;
+				sp->s_phase = MK_RULEDEPS;
+				break;
+			}
+#endif
+			end_rule(sp);
+			sp->s_rule = rp->r_next;
+			break;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		case MK_RULEDEPS:
+			if ((dep = next_dep(sp)) || sp->s_pending)
+				return dep;
+			unmark_deps(sp->s_rule);
+			end_rule(sp);
+			sp->s_rule = sp->s_rule->r_next;
+			sp->s_phase = MK_RULE;
+			// Each rule's commands must finish before the next rule
+			// is considered.
+			if ((np->n_flag & N_RUNNING)) {
+				sp->s_phase = MK_RULEJOB;
+				return NULL;
+			}
+			break;
+		case MK_RULEJOB:
+			if ((np->n_flag & N_FAILED))
+				sp->s_estat |= MAKE_FAILURE;
+			sp->s_phase = MK_RULE;
+			break;
+#endif
+		default:
+			return NULL;
+		}
+	}
+}
+
+/*
+ * Make a list of goals and, first, their prerequisites.  The targets
+ * waiting for prerequisites are kept on a stack rather than by
+ * recursion, so long chains of prerequisites can be handled.  The
+ * list is terminated by a NULL pointer.
+ *
+ * When jobs are run in parallel a target whose prerequisites are
+ * still being made is set aside and the walk of the graph continues
+ * with its siblings, then with the next goal.  It's resumed when the
+ * last of them is finished.  We only wait for a job to finish when no
+ * target can proceed.  Return when all the goals have been made.
+ */
+int
+make_goals(struct name **goals, int level)
+{
+	struct mkstate *sp = NULL, *parent;
+	struct name *np = NULL;
+	int *result, estat = 0;
+	size_t i, n, next = 0;
+
+	for (n = 0; goals[n]; n++)
+		;
+	result = xmalloc((n + 1) * sizeof(int));
+
+	for (;;) {
+		if (!np && !sp && next < n) {
+			// Start the next goal, unless it's already been made
+			i = next++;
+			result[i] = -1;
+			np = goals[i];
+			if ((np->n_flag & N_DONE) && !np->n_state) {
+				result[i] = 0;
+				np = NULL;
+				continue;
+			} else if (np->n_state) {
+				// Already being made, as a prerequisite or repeated goal
+				if (!np->n_state->s_result)
+					np->n_state->s_result = &result[i];
+				else
+					result[i] = 0;
+				np = NULL;
+				continue;
+			}
+		}
+
+		if (np) {
+			if (np->n_flag & N_DOING)
+				error("circular dependency for %s", np->n_name);
+			np->n_flag |= N_DOING;
+
+			parent = sp;
+			sp = xmalloc(sizeof(struct mkstate));
+			*sp = (struct mkstate){
+				.s_parent = parent,
+				.s_name = np,
+				.s_level = parent ? parent->s_level + 1 : level,
+				.s_phase = MK_START,
+				.s_result = parent ? NULL : &result[next - 1],
+				.s_dtim = {1, 0}
+			};
+			np->n_state = sp;
+		} else if (sp == NULL) {
+			for (i = 0; i < n && result[i] >= 0; i++)
+				;
+			if (i == n)
+				break;
+			if (readyhead) {
+				// Continue with a target whose prerequisites are made
+				sp = readyhead;
+				if ((readyhead = sp->s_next) == NULL)
+					readytail = &readyhead;
+				sp->s_name->n_flag |= N_DOING;
+			} else {
+				wait_jobs();
+				continue;
+			}
+		}
+
+		if ((np = make_step(sp)) == NULL) {
+			// The target can't proceed:  continue with the one which
+			// needed it, if any.  That has to wait for it to finish.
+			parent = sp->s_parent;
+			sp->s_parent = NULL;
+			sp->s_name->n_flag &= ~N_DOING;
+			if (parent)
+				wait_for(parent, sp);
+			if (sp->s_phase == MK_DONE)
+				finish_state(sp);
+			else
+				sp->s_parked = sp->s_phase != MK_JOB;
+			sp = parent;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		estat |= result[i];
+	free(result);
 	return estat;
 }
+
+/*
+ * Make a single goal.
+ */
+int
+make(struct name *np, int level)
+{
+	struct name *goals[2] = {np, NULL};
+
+	return make_goals(goals, level);
+}
@@ -25,6 +25,11 @@
 #include <time.h>
 #include <unistd.h>
 
+#if !defined(WIN32) && !defined(WIN64)
+#include <poll.h>
+#include <sys/resource.h>
+#endif
+
 #if defined(WIN32) || defined (WIN64)
 #include "win32ex.h"
 #define NORETURN __declspec(noreturn)
@@ -93,6 +98,95 @@ extern char **environ;
 # define POSIX_2017 FALSE
 #endif
 
+// If ENABLE_FEATURE_MAKE_JOBSERVER is non-zero parallel jobs are shared
+// with recursive invocations of make using a GNU make compatible jobserver.
+#ifndef ENABLE_FEATURE_MAKE_JOBSERVER
+# define ENABLE_FEATURE_MAKE_JOBSERVER \
+		(ENABLE_FEATURE_MAKE_EXTENSIONS && ENABLE_FEATURE_MAKE_POSIX_2024)
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_JOBSERVER
+# define ENABLE_FEATURE_MAKE_JOBSERVER 0
+#endif
+
+// If ENABLE_FEATURE_MAKE_JOB_TIMES is non-zero the time taken to make
+// each target is logged when jobs are run in parallel and the environment
+// variable PDPMAKE_JOBTIMES is set.  Later runs start the jobs on the
+// longest chains of dependent targets first.
+#ifndef ENABLE_FEATURE_MAKE_JOB_TIMES
+# define ENABLE_FEATURE_MAKE_JOB_TIMES \
+		(ENABLE_FEATURE_MAKE_EXTENSIONS && ENABLE_FEATURE_MAKE_POSIX_2024)
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_JOB_TIMES
+# define ENABLE_FEATURE_MAKE_JOB_TIMES 0
+#endif
+
+// If ENABLE_FEATURE_MAKE_OUTPUT_SYNC is non-zero the output of jobs run
+// in parallel can be collected and written without being interleaved.
+#ifndef ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+# define ENABLE_FEATURE_MAKE_OUTPUT_SYNC ENABLE_FEATURE_MAKE_EXTENSIONS
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+# define ENABLE_FEATURE_MAKE_OUTPUT_SYNC 0
+#endif
+
+// If ENABLE_FEATURE_MAKE_COSHELL is non-zero commands which need a shell
+// can be sent to long-lived shell processes rather than each starting one.
+#ifndef ENABLE_FEATURE_MAKE_COSHELL
+# define ENABLE_FEATURE_MAKE_COSHELL ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_COSHELL
+# define ENABLE_FEATURE_MAKE_COSHELL 0
+#endif
+#if ENABLE_FEATURE_MAKE_COSHELL && !ENABLE_FEATURE_MAKE_OUTPUT_SYNC
+# error "ENABLE_FEATURE_MAKE_COSHELL requires ENABLE_FEATURE_MAKE_OUTPUT_SYNC"
+#endif
+
+// If ENABLE_FEATURE_MAKE_RUSAGE is non-zero the resources used by each
+// command can be written to the file named by PDPMAKE_RUSAGE.
+#ifndef ENABLE_FEATURE_MAKE_RUSAGE
+# define ENABLE_FEATURE_MAKE_RUSAGE ENABLE_FEATURE_MAKE_EXTENSIONS
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_RUSAGE
+# define ENABLE_FEATURE_MAKE_RUSAGE 0
+#endif
+
+// If ENABLE_FEATURE_MAKE_PREFETCH is non-zero the modification times of
+// files are fetched by several threads before targets are made.
+#ifndef ENABLE_FEATURE_MAKE_PREFETCH
+# define ENABLE_FEATURE_MAKE_PREFETCH ENABLE_FEATURE_MAKE_EXTENSIONS
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_PREFETCH
+# define ENABLE_FEATURE_MAKE_PREFETCH 0
+#endif
+
+// If ENABLE_FEATURE_MAKE_SHELL_CACHE is non-zero the results of '!='
+// assignments can be saved in the file named by PDPMAKE_SHELLCACHE.
+#ifndef ENABLE_FEATURE_MAKE_SHELL_CACHE
+# define ENABLE_FEATURE_MAKE_SHELL_CACHE \
+		(ENABLE_FEATURE_MAKE_EXTENSIONS && ENABLE_FEATURE_MAKE_POSIX_2024)
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_SHELL_CACHE
+# define ENABLE_FEATURE_MAKE_SHELL_CACHE 0
+#endif
+
+// If ENABLE_FEATURE_MAKE_MACRO_STATS is non-zero the number of times
+// each macro is expanded, and the time taken, can be written to the file
+// named by PDPMAKE_MACROSTATS.
+#ifndef ENABLE_FEATURE_MAKE_MACRO_STATS
+# define ENABLE_FEATURE_MAKE_MACRO_STATS ENABLE_FEATURE_MAKE_EXTENSIONS
+#endif
+#if defined(_WIN32) || defined(_WIN64)
+# undef ENABLE_FEATURE_MAKE_MACRO_STATS
+# define ENABLE_FEATURE_MAKE_MACRO_STATS 0
+#endif
+
 // If ENABLE_FEATURE_CLEAN_UP is non-zero all allocated structures are
 // freed at the end of main().  This isn't necessary but it's a nice test.
 #ifndef ENABLE_FEATURE_CLEAN_UP
@@ -117,7 +211,7 @@ extern char **environ;
 #endif
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-#define OPTSTR1 "+ehij:knqrsSt"
+#define OPTSTR1 "+ehij:kl:nO:qrsSt"
 #elif ENABLE_FEATURE_MAKE_POSIX_2024
 #define OPTSTR1 "+eij:knqrsSt"
 #else
@@ -135,7 +229,9 @@ enum {
 	OPTBIT_i,
 	IF_FEATURE_MAKE_POSIX_2024(OPTBIT_j,)
 	OPTBIT_k,
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_l,)
 	OPTBIT_n,
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_O,)
 	OPTBIT_q,
 	OPTBIT_r,
 	OPTBIT_s,
@@ -155,7 +251,9 @@ enum {
 	OPT_i = (1 << OPTBIT_i),
 	OPT_j = IF_FEATURE_MAKE_POSIX_2024((1 << OPTBIT_j)) + 0,
 	OPT_k = (1 << OPTBIT_k),
+	OPT_l = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_l)) + 0,
 	OPT_n = (1 << OPTBIT_n),
+	OPT_O = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_O)) + 0,
 	OPT_q = (1 << OPTBIT_q),
 	OPT_r = (1 << OPTBIT_r),
 	OPT_s = (1 << OPTBIT_s),
@@ -196,6 +294,15 @@ struct name {
 	struct rule *n_rule;	// Rules to build this (prerequisites/commands)
 	struct timespec n_tim;	// Modification time of this name
 	uint16_t n_flag;		// Info about the name
+	unsigned int n_hash;	// Hash of name
+	struct mkstate *n_state;	// Progress while being made, if unfinished
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct pool *n_pool;	// Pool limiting jobs to make this, if any
+#endif
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+	uint32_t n_msec;		// Time taken to make target (ms)
+	uint32_t n_cost;		// Time to make target and those depending on it
+#endif
 };
 
 #define N_DOING		0x01	// Name in process of being built
@@ -219,6 +326,19 @@ struct name {
 #define N_PHONY		0		// No support for phony targets
 #endif
 #define N_INFERENCE	0x400	// Inference rule
+#define N_RUNNING	0x800	// Commands to make target haven't finished
+#define N_FAILED	0x1000	// Commands to make target failed
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+#define N_WAIT		0x2000	// .WAIT barrier in a prerequisite list
+#else
+#define N_WAIT		0		// No support for .WAIT
+#endif
+#define N_PLAN		0x4000	// Visited while planning jobs
+#if ENABLE_FEATURE_MAKE_PREFETCH
+#define N_FETCHED	0x8000	// Modification time was fetched in advance
+#else
+#define N_FETCHED	0
+#endif
 
 // List of rules to build a target
 struct rule {
@@ -243,8 +363,21 @@ struct cmd {
 	int c_refcnt;			// Reference count
 	const char *c_makefile;	// Makefile in which command was defined
 	int c_dispno;			// Line number within makefile
+	int c_auto;				// Internal macros used by list, see A_*
+	struct tmpl *c_tmpl;	// Compiled form of command
 };
 
+// Internal macros referenced by a list of commands
+#define A_TARGET	0x01	// $@
+#define A_MEMBER	0x02	// $%
+#define A_OODATE	0x04	// $?
+#define A_PREREQ	0x08	// $<
+#define A_BASE		0x10	// $*
+#define A_ALLSRC	0x20	// $+
+#define A_DEDUP		0x40	// $^
+#define A_ALL		0x7f
+#define A_SCANNED	0x80	// c_auto is valid
+
 // Macro storage
 struct macro {
 	struct macro *m_next;	// Next variable
@@ -255,6 +388,18 @@ struct macro {
 #endif
 	bool m_flag;			// Infinite loop check
 	uint8_t m_level;		// Level at which macro was created
+	unsigned int m_hash;	// Hash of name
+	struct tmpl *m_tmpl;	// Compiled form of value
+	char *m_cache;			// Saved expansion of value
+	unsigned int m_gen;		// Value of macrogen when it was saved
+	unsigned int m_autogen;	// Value of autogen when it was saved
+	int m_mode;				// Options in effect when it was saved
+	uint8_t m_memo;			// Properties of saved expansion
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+	unsigned long m_count;	// Number of times expanded
+	uint64_t m_bytes;		// Total length of expansions
+	uint64_t m_nsec;		// Total time taken, including nested macros
+#endif
 };
 
 // List of file names
@@ -263,6 +408,13 @@ struct file {
 	char *f_name;
 };
 
+// String which grows as words are appended
+struct strbuf {
+	char *sb_buf;			// Allocated string, NULL if empty
+	size_t sb_len;			// Length of string
+	size_t sb_size;			// Space allocated
+};
+
 // Flags passed to setmacro()
 #define M_IMMEDIATE  0x08	// immediate-expansion macro is being defined
 #define M_VALID      0x10	// assert macro name is valid
@@ -292,22 +444,52 @@ enum {
 #endif
 };
 
+// Values of -O option
+enum {
+	OUTSYNC_NONE = 0,	// Output of jobs isn't collected
+	OUTSYNC_LINE,		// Output collected for each command line
+	OUTSYNC_TARGET,		// Output collected for each target
+};
+
 // Status of make()
 #define MAKE_FAILURE		0x01
 #define MAKE_DIDSOMETHING	0x02
 
 extern const char *myname;
 extern const char *makefile;
-extern struct name *namehead[HTABSIZE];
-extern struct macro *macrohead[HTABSIZE];
+extern struct name **namehead;
+extern int namesize;
+extern struct macro **macrohead;
+extern int macrosize;
 extern struct name *firstname;
-extern struct name *target;
 extern uint32_t opts;
 extern int lineno;
 extern int dispno;
+extern int maxjobs;
+extern unsigned int macrogen;
+extern unsigned int autogen;
+extern bool nomemo;
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+extern char *macrostats;
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+extern char *maxload;
+extern double loadlimit;
+extern int outsync;
+extern bool oneshell;
+#endif
+#if ENABLE_FEATURE_MAKE_COSHELL
+extern bool coshell;
+#endif
+#if ENABLE_FEATURE_MAKE_PREFETCH
+extern unsigned long cmdcount;
+#endif
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 extern char *numjobs;
 #endif
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+extern char *jobserver_auth;
+#endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 extern bool posix;
 extern bool seen_first;
@@ -325,25 +507,56 @@ void print_details(void);
 #define expand_macros(s, e) expand_macros(s)
 #endif
 char *expand_macros(const char *str, int except_dollar);
+char *expand_command(struct cmd *cp);
+void free_tmpl(struct tmpl *tp);
+int auto_macros(struct cmd *cp);
 void input(FILE *fd, int ilevel);
+#if ENABLE_FEATURE_MAKE_SHELL_CACHE
+void save_shell_cache(void);
+#endif
 struct macro *getmp(const char *name);
 void setmacro(const char *name, const char *val, int level);
 void freemacros(void);
+#if ENABLE_FEATURE_MAKE_MACRO_STATS
+void report_macros(void);
+#endif
 void remove_target(void);
+int docmds(struct name *np, struct cmd *cp);
+void wait_jobs(void);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+void init_pools(void);
+#endif
+#if ENABLE_FEATURE_MAKE_JOBSERVER
+void jobserver_init(int forced);
+#endif
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+void load_times(const char *name);
+void save_times(void);
+void plan_jobs(struct name *goal);
+#endif
+void update_time(struct name *np);
+void job_finished(struct name *np);
 int make(struct name *np, int level);
+int make_goals(struct name **goals, int level);
 char *splitlib(const char *name, char **member);
 void modtime(struct name *np);
+#if ENABLE_FEATURE_MAKE_PREFETCH
+void prefetch_times(struct name *goal);
+int stale_time(struct name *np);
+#endif
+void need_time(struct name *np);
 char *suffix(const char *name);
 int is_suffix(const char *s);
+struct name *namecat(const char *s, const char *t, int create);
 struct name *dyndep(struct name *np, struct rule *imprule);
 char *getrules(char *s, int size);
 struct name *findname(const char *name);
 struct name *newname(const char *name);
 struct cmd *getcmd(struct name *np);
 void freenames(void);
-struct depend *newdep(struct name *np, struct depend *dp);
+struct depend **newdep(struct name *np, struct depend **dpp);
 void freedeps(struct depend *dp);
-struct cmd *newcmd(char *str, struct cmd *cp);
+struct cmd **newcmd(char *str, struct cmd **cpp);
 void freecmds(struct cmd *cp);
 void freerules(struct rule *rp);
 void set_pragma(const char *name);
@@ -362,9 +575,14 @@ void *xrealloc(void *ptr, size_t len);
 char *xconcat3(const char *s1, const char *s2, const char *s3);
 char *xstrdup(const char *s);
 char *xstrndup(const char *s, size_t n);
+void *xarena(size_t len);
+char *xarenadup(const char *s);
+void freearena(void);
 char *xappendword(const char *str, const char *word);
-unsigned int getbucket(const char *name);
-struct file *newfile(char *str, struct file *fphead);
+void sb_append(struct strbuf *sb, const char *str, size_t len);
+void sb_appendword(struct strbuf *sb, const char *word);
+unsigned int gethash(const char *name);
+struct file **newfile(char *str, struct file **fpp);
 void freefiles(struct file *fp);
 int is_valid_target(const char *name);
 void pragmas_from_env(void);
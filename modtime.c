@@ -3,6 +3,9 @@
  */
 #include "make.h"
 #include <ar.h>
+#if ENABLE_FEATURE_MAKE_PREFETCH
+#include <pthread.h>
+#endif
 
 /*
  * Read a number from an archive header.
@@ -176,3 +179,171 @@ modtime(struct name *np)
 	}
 	free(name);
 }
+
+#if ENABLE_FEATURE_MAKE_PREFETCH
+#define PREFETCH_THREADS 8
+
+// Number of commands started when times were last fetched in advance
+static unsigned long fetchcount;
+
+struct prefetch {
+	struct name **pf_name;	// Names whose times are wanted
+	size_t pf_count;
+	size_t pf_first;		// Each thread handles every pf_step'th name
+	size_t pf_step;
+};
+
+static void *
+prefetch_thread(void *arg)
+{
+	struct prefetch *pf = arg;
+	struct name *np;
+	struct stat info;
+	size_t i;
+
+	for (i = pf->pf_first; i < pf->pf_count; i += pf->pf_step) {
+		np = pf->pf_name[i];
+		if (stat(np->n_name, &info) == 0) {
+			np->n_tim.tv_sec = info.st_mtim.tv_sec;
+			np->n_tim.tv_nsec = info.st_mtim.tv_nsec;
+			np->n_flag |= N_FETCHED;
+		} else if (errno == ENOENT) {
+			np->n_flag |= N_FETCHED;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a name to the list of those reachable from a goal.
+ */
+static void
+add_name(struct name *np, struct name ***list, size_t *nlist, size_t *size)
+{
+	if ((np->n_flag & (N_MARK | N_DONE | N_WAIT)) || np->n_state)
+		return;
+	np->n_flag |= N_MARK;
+	if (*nlist == *size)
+		*list = xrealloc(*list, (*size *= 2) * sizeof(**list));
+	(*list)[(*nlist)++] = np;
+}
+
+/*
+ * Get the modification times of the files reachable from a goal using
+ * several threads, so the latency of stat() on network filesystems is
+ * overlapped.  For names without commands this includes the implicit
+ * prerequisites dyndep() may look for.  Times fetched before commands
+ * were run are fetched again.  Errors other than a missing file are
+ * left for modtime() to report when the time is needed.
+ */
+void
+prefetch_times(struct name *goal)
+{
+	struct name **list = NULL, *np, *xp, *sp;
+	struct rule *rp;
+	struct depend *dp;
+	struct prefetch pf[PREFETCH_THREADS];
+	pthread_t tid[PREFETCH_THREADS];
+	bool started[PREFETCH_THREADS];
+	size_t nlist = 0, size = 0, nstat = 0, i, j;
+	char *name, *suff;
+
+	if ((goal->n_flag & N_DONE))
+		return;
+
+	// Find all names reachable from the goal.  The start of the list
+	// is used as a stack of names whose prerequisites haven't been
+	// seen, the end holds those with unknown times.
+	list = xmalloc((size = 64) * sizeof(*list));
+	list[nlist++] = goal;
+	goal->n_flag |= N_MARK;
+	xp = findname(".SUFFIXES");
+	for (i = 0; i < nlist; i++) {
+		np = list[i];
+		for (rp = np->n_rule; rp; rp = rp->r_next) {
+			for (dp = rp->r_dep; dp; dp = dp->d_next)
+				add_name(dp->d_name, &list, &nlist, &size);
+		}
+
+		// Candidates for the implicit prerequisite, as in dyndep()
+		if (xp && !getcmd(np) && !strchr(np->n_name, '(') &&
+				!(np->n_flag & (N_PHONY | N_SPECIAL))) {
+			name = xstrdup(np->n_name);
+			suff = xstrdup(suffix(name));
+			*suffix(name) = '\0';
+			for (rp = xp->n_rule; rp; rp = rp->r_next) {
+				for (dp = rp->r_dep; dp; dp = dp->d_next) {
+					sp = namecat(dp->d_name->n_name, suff, FALSE);
+					if (sp && sp->n_rule)
+						add_name(namecat(name, dp->d_name->n_name, TRUE),
+									&list, &nlist, &size);
+				}
+			}
+			free(suff);
+			free(name);
+		}
+	}
+
+	// Keep those whose time is needed, excluding archive members
+	for (i = 0; i < nlist; i++) {
+		np = list[i];
+		np->n_flag &= ~N_MARK;
+		if ((np->n_flag & N_FETCHED) && fetchcount != cmdcount) {
+			np->n_flag &= ~N_FETCHED;
+			np->n_tim.tv_sec = np->n_tim.tv_nsec = 0;
+		}
+		if (!np->n_tim.tv_sec && !(np->n_flag & N_FETCHED) &&
+				!strchr(np->n_name, '('))
+			list[nstat++] = np;
+	}
+	fetchcount = cmdcount;
+
+	// Not worth starting threads for a few names
+	j = nstat >= 2 * PREFETCH_THREADS ? PREFETCH_THREADS : 1;
+	for (i = 0; i < j; i++) {
+		pf[i].pf_name = list;
+		pf[i].pf_count = nstat;
+		pf[i].pf_first = i;
+		pf[i].pf_step = j;
+		started[i] = j > 1 && pthread_create(&tid[i], NULL,
+								prefetch_thread, &pf[i]) == 0;
+		if (!started[i])
+			prefetch_thread(&pf[i]);
+	}
+	for (i = 0; i < j; i++) {
+		if (started[i])
+			pthread_join(tid[i], NULL);
+	}
+	free(list);
+}
+
+/*
+ * Return TRUE if the time of a name was fetched in advance but
+ * commands have been run since, so it may have changed.
+ */
+int
+stale_time(struct name *np)
+{
+	return (np->n_flag & N_FETCHED) && fetchcount != cmdcount;
+}
+#endif
+
+/*
+ * Get the modification time of a name unless it's already known.
+ * A time fetched in advance is only used if no commands have been
+ * run since.
+ */
+void
+need_time(struct name *np)
+{
+#if ENABLE_FEATURE_MAKE_PREFETCH
+	if ((np->n_flag & N_FETCHED)) {
+		np->n_flag &= ~N_FETCHED;
+		if (fetchcount == cmdcount)
+			return;
+		np->n_tim.tv_sec = 0;
+	}
+#endif
+	if (!np->n_tim.tv_sec)
+		modtime(np);
+}
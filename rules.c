@@ -18,7 +18,7 @@ suffix(const char *name)
  * Find a name structure whose name is formed by concatenating two
  * strings.  If 'create' is TRUE the name is created if necessary.
  */
-static struct name *
+struct name *
 namecat(const char *s, const char *t, int create)
 {
 	char *p;
@@ -79,8 +79,7 @@ dyndep(struct name *np, struct rule *imprule)
 				if ((ip->n_flag & N_DOING))
 					continue;
 
-				if (!ip->n_tim.tv_sec)
-					modtime(ip);
+				need_time(ip);
 
 				if (!chain) {
 					got_ip = ip->n_tim.tv_sec || (ip->n_flag & N_TARGET);
@@ -96,8 +95,14 @@ dyndep(struct name *np, struct rule *imprule)
 				if (got_ip) {
 					// Prerequisite exists or we know how to make it
 					if (imprule) {
-						imprule->r_dep = newdep(ip, NULL);
+						imprule->r_dep = NULL;
+						newdep(ip, &imprule->r_dep);
 						imprule->r_cmd = sp->n_rule->r_cmd;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+						// Jobs using the rule's commands share its pool
+						if (!np->n_pool)
+							np->n_pool = sp->n_pool;
+#endif
 					}
 					pp = ip;
 					goto finish;
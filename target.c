@@ -3,30 +3,31 @@
  */
 #include "make.h"
 
+// Structures are allocated from the arena.  Those which are freed are
+// kept on these lists for reuse.
+static struct depend *freedep;
+static struct cmd *freecmd;
+static struct rule *freerule;
+
 /*
- * Add a prerequisite to the end of the supplied list.
- * Return the new head pointer for that list.
+ * Add a prerequisite to the end of a list, given a pointer to its
+ * terminating NULL.  Return the list's new tail pointer.
  */
-struct depend *
-newdep(struct name *np, struct depend *dphead)
+struct depend **
+newdep(struct name *np, struct depend **dpp)
 {
 	struct depend *dpnew;
-	struct depend *dp;
 
-	dpnew = xmalloc(sizeof(struct depend));
+	if ((dpnew = freedep) != NULL)
+		freedep = dpnew->d_next;
+	else
+		dpnew = xarena(sizeof(struct depend));
 	dpnew->d_next = NULL;
 	dpnew->d_name = np;
 	dpnew->d_refcnt = 0;
 
-	if (dphead == NULL)
-		return dpnew;
-
-	for (dp = dphead; dp->d_next; dp = dp->d_next)
-		;
-
-	dp->d_next = dpnew;
-
-	return dphead;
+	*dpp = dpnew;
+	return &dpnew->d_next;
 }
 
 void
@@ -37,40 +38,43 @@ freedeps(struct depend *dp)
 	if (dp && --dp->d_refcnt <= 0) {
 		for (; dp; dp = nextdp) {
 			nextdp = dp->d_next;
-			free(dp);
+			dp->d_next = freedep;
+			freedep = dp;
 		}
 	}
 }
 
 /*
- * Add a command to the end of the supplied list of commands.
- * Return the new head pointer for that list.
+ * Add a command to the end of a list, given a pointer to its
+ * terminating NULL.  Return the list's new tail pointer.
  */
-struct cmd *
-newcmd(char *str, struct cmd *cphead)
+struct cmd **
+newcmd(char *str, struct cmd **cpp)
 {
+	static const char *lastmf;
 	struct cmd *cpnew;
-	struct cmd *cp;
 
 	while (isspace(*str))
 		str++;
 
-	cpnew = xmalloc(sizeof(struct cmd));
+	// Commands from the same makefile share a copy of its name
+	if (makefile && (lastmf == NULL || strcmp(makefile, lastmf) != 0))
+		lastmf = xarenadup(makefile);
+
+	if ((cpnew = freecmd) != NULL)
+		freecmd = cpnew->c_next;
+	else
+		cpnew = xarena(sizeof(struct cmd));
 	cpnew->c_next = NULL;
-	cpnew->c_cmd = xstrdup(str);
+	cpnew->c_cmd = xarenadup(str);
 	cpnew->c_refcnt = 0;
-	cpnew->c_makefile = makefile ? xstrdup(makefile) : NULL;
+	cpnew->c_makefile = makefile ? lastmf : NULL;
 	cpnew->c_dispno = dispno;
+	cpnew->c_auto = 0;
+	cpnew->c_tmpl = NULL;
 
-	if (cphead == NULL)
-		return cpnew;
-
-	for (cp = cphead; cp->c_next; cp = cp->c_next)
-		;
-
-	cp->c_next = cpnew;
-
-	return cphead;
+	*cpp = cpnew;
+	return &cpnew->c_next;
 }
 
 void
@@ -81,28 +85,65 @@ freecmds(struct cmd *cp)
 	if (cp && --cp->c_refcnt <= 0) {
 		for (; cp; cp = nextcp) {
 			nextcp = cp->c_next;
-			free(cp->c_cmd);
-			free((void *)cp->c_makefile);
-			free(cp);
+			free_tmpl(cp->c_tmpl);
+			cp->c_tmpl = NULL;
+			cp->c_next = freecmd;
+			freecmd = cp;
 		}
 	}
 }
 
-struct name *namehead[HTABSIZE];
+// The hash table of names starts with HTABSIZE buckets and grows as
+// names are added.
+static struct name *nametab[HTABSIZE];
+struct name **namehead = nametab;
+int namesize = HTABSIZE;
+static int namecount;
 struct name *firstname;
 
-struct name *
-findname(const char *name)
+static struct name *
+lookup_name(const char *name, unsigned int hash)
 {
 	struct name *np;
 
-	for (np = namehead[getbucket(name)]; np; np = np->n_next) {
-		if (strcmp(name, np->n_name) == 0)
+	for (np = namehead[hash % namesize]; np; np = np->n_next) {
+		if (np->n_hash == hash && strcmp(name, np->n_name) == 0)
 			return np;
 	}
 	return NULL;
 }
 
+struct name *
+findname(const char *name)
+{
+	return lookup_name(name, gethash(name));
+}
+
+/*
+ * When there are more names than buckets make the hash table about
+ * twice as big.
+ */
+static void
+grow_names(void)
+{
+	struct name **head, *np, *nextnp;
+	int i, size = 2 * namesize + 1;
+
+	head = xmalloc(size * sizeof(*head));
+	memset(head, 0, size * sizeof(*head));
+	for (i = 0; i < namesize; i++) {
+		for (np = namehead[i]; np; np = nextnp) {
+			nextnp = np->n_next;
+			np->n_next = head[np->n_hash % size];
+			head[np->n_hash % size] = np;
+		}
+	}
+	if (namehead != nametab)
+		free(namehead);
+	namehead = head;
+	namesize = size;
+}
+
 static int
 check_name(const char *name)
 {
@@ -178,7 +219,8 @@ potentially_valid_target(const char *name)
 struct name *
 newname(const char *name)
 {
-	struct name *np = findname(name);
+	unsigned int hash = gethash(name);
+	struct name *np = lookup_name(name, hash);
 
 	if (np == NULL) {
 		unsigned int bucket;
@@ -192,14 +234,24 @@ newname(const char *name)
 			error("invalid target name '%s'", name);
 #endif
 
-		bucket = getbucket(name);
-		np = xmalloc(sizeof(struct name));
+		if (++namecount > namesize)
+			grow_names();
+		bucket = hash % namesize;
+		np = xarena(sizeof(struct name));
 		np->n_next = namehead[bucket];
 		namehead[bucket] = np;
-		np->n_name = xstrdup(name);
+		np->n_hash = hash;
+		np->n_name = xarenadup(name);
 		np->n_rule = NULL;
 		np->n_tim = (struct timespec){0, 0};
 		np->n_flag = 0;
+		np->n_state = NULL;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		np->n_pool = NULL;
+#endif
+#if ENABLE_FEATURE_MAKE_JOB_TIMES
+		np->n_msec = np->n_cost = 0;
+#endif
 	}
 	return np;
 }
@@ -222,20 +274,33 @@ getcmd(struct name *np)
 }
 
 #if ENABLE_FEATURE_CLEAN_UP
+/*
+ * The names themselves are in the arena, only the hash table and the
+ * compiled forms of commands need to be freed.
+ */
 void
 freenames(void)
 {
+	struct name *np;
+	struct rule *rp;
+	struct cmd *cp;
 	int i;
-	struct name *np, *nextnp;
 
-	for (i = 0; i < HTABSIZE; i++) {
-		for (np = namehead[i]; np; np = nextnp) {
-			nextnp = np->n_next;
-			free(np->n_name);
-			freerules(np->n_rule);
-			free(np);
+	for (i = 0; i < namesize; i++) {
+		for (np = namehead[i]; np; np = np->n_next) {
+			for (rp = np->n_rule; rp; rp = rp->r_next) {
+				// Commands may be shared, so only free each once
+				for (cp = rp->r_cmd; cp; cp = cp->c_next) {
+					free_tmpl(cp->c_tmpl);
+					cp->c_tmpl = NULL;
+				}
+			}
 		}
 	}
+	if (namehead != nametab)
+		free(namehead);
+	namehead = nametab;
+	namesize = HTABSIZE;
 }
 #endif
 
@@ -248,7 +313,8 @@ freerules(struct rule *rp)
 		nextrp = rp->r_next;
 		freedeps(rp->r_dep);
 		freecmds(rp->r_cmd);
-		free(rp);
+		rp->r_next = freerule;
+		freerule = rp;
 	}
 }
 
@@ -387,7 +453,11 @@ addrule(struct name *np, struct depend *dp, struct cmd *cp, int flag)
 	while (*rpp)
 		rpp = &(*rpp)->r_next;
 
-	*rpp = rp = xmalloc(sizeof(struct rule));
+	if ((rp = freerule) != NULL)
+		freerule = rp->r_next;
+	else
+		rp = xarena(sizeof(struct rule));
+	*rpp = rp;
 	rp->r_next = NULL;
 	rp->r_dep = inc_ref(dp);
 	rp->r_cmd = inc_ref(cp);
@@ -127,6 +127,90 @@ xstrndup(const char *s, size_t n)
 	return t;
 }
 
+/*
+ * The graph of names, rules, prerequisites and commands is allocated
+ * from an arena: a list of large chunks which are only freed when make
+ * exits.  This is quicker than malloc(), wastes no space on headers
+ * and keeps related structures close together.
+ */
+#define ARENA_CHUNK 65536
+
+struct chunk {
+	struct chunk *ch_next;
+	union {
+		long double d;
+		long long l;
+		void *p;
+	} ch_data[];
+};
+
+#define ARENA_ALIGN sizeof(((struct chunk *)0)->ch_data[0])
+
+static struct chunk *arena;
+static char *arenaptr;		// Free space in current chunk
+static size_t arenaleft;
+
+static void *
+arena_alloc(size_t len, size_t align)
+{
+	struct chunk *ch;
+	size_t pad = -(uintptr_t)arenaptr & (align - 1);
+	void *ret;
+
+	if (len + pad > arenaleft) {
+		ch = xmalloc(sizeof(struct chunk) + MAX(len, ARENA_CHUNK));
+		if (len > ARENA_CHUNK / 4 && arena) {
+			// Large allocations get a chunk of their own
+			ch->ch_next = arena->ch_next;
+			arena->ch_next = ch;
+			return ch->ch_data;
+		}
+		ch->ch_next = arena;
+		arena = ch;
+		arenaptr = (char *)ch->ch_data;
+		arenaleft = MAX(len, ARENA_CHUNK);
+		pad = 0;
+	}
+	ret = arenaptr + pad;
+	arenaptr += len + pad;
+	arenaleft -= len + pad;
+	return ret;
+}
+
+/*
+ * Allocate memory suitably aligned for any structure from the arena.
+ */
+void *
+xarena(size_t len)
+{
+	return arena_alloc(len, ARENA_ALIGN);
+}
+
+/*
+ * Copy a string to the arena.
+ */
+char *
+xarenadup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	return memcpy(arena_alloc(len, 1), s, len);
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+freearena(void)
+{
+	struct chunk *ch;
+
+	while ((ch = arena) != NULL) {
+		arena = ch->ch_next;
+		free(ch);
+	}
+	arenaptr = NULL;
+	arenaleft = 0;
+}
+#endif
+
 /*
  * Append a word to a space-separated string of words.  The first
  * call should use a NULL pointer for str, subsequent calls should
@@ -140,40 +224,80 @@ xappendword(const char *str, const char *word)
 	return newstr;
 }
 
+/*
+ * Make sure a buffer has space for len more characters and a NUL.
+ * The buffer grows geometrically so building a long string takes
+ * time proportional to its length.
+ */
+static void
+sb_grow(struct strbuf *sb, size_t len)
+{
+	size_t need = sb->sb_len + len + 1;
+
+	if (need > sb->sb_size) {
+		sb->sb_size = MAX(need, 2 * sb->sb_size);
+		sb->sb_size = MAX(sb->sb_size, 64);
+		sb->sb_buf = xrealloc(sb->sb_buf, sb->sb_size);
+	}
+}
+
+/*
+ * Append len characters of a string to a buffer.
+ */
+void
+sb_append(struct strbuf *sb, const char *str, size_t len)
+{
+	sb_grow(sb, len);
+	memcpy(sb->sb_buf + sb->sb_len, str, len);
+	sb->sb_len += len;
+	sb->sb_buf[sb->sb_len] = '\0';
+}
+
+/*
+ * Append a word to a space-separated string of words in a buffer.
+ */
+void
+sb_appendword(struct strbuf *sb, const char *word)
+{
+	size_t len = strlen(word);
+
+	sb_grow(sb, len + 1);
+	if (sb->sb_len)
+		sb->sb_buf[sb->sb_len++] = ' ';
+	memcpy(sb->sb_buf + sb->sb_len, word, len + 1);
+	sb->sb_len += len;
+}
+
+/*
+ * Return the hash of a name.  The hash table bucket is the remainder
+ * when this is divided by the size of the table.
+ */
 unsigned int
-getbucket(const char *name)
+gethash(const char *name)
 {
 	unsigned int hashval = 0;
 	const unsigned char *p = (unsigned char *)name;
 
 	while (*p)
 		hashval ^= (hashval << 5) + (hashval >> 2) + *p++;
-	return hashval % HTABSIZE;
+	return hashval;
 }
 
 /*
- * Add a file to the end of the supplied list of files.
- * Return the new head pointer for that list.
+ * Add a file to the end of a list, given a pointer to its
+ * terminating NULL.  Return the list's new tail pointer.
  */
-struct file *
-newfile(char *str, struct file *fphead)
+struct file **
+newfile(char *str, struct file **fpp)
 {
 	struct file *fpnew;
-	struct file *fp;
 
 	fpnew = xmalloc(sizeof(struct file));
 	fpnew->f_next = NULL;
 	fpnew->f_name = xstrdup(str);
 
-	if (fphead == NULL)
-		return fpnew;
-
-	for (fp = fphead; fp->f_next; fp = fp->f_next)
-		;
-
-	fp->f_next = fpnew;
-
-	return fphead;
+	*fpp = fpnew;
+	return &fpnew->f_next;
 }
 
 #if ENABLE_FEATURE_CLEAN_UP